@@ -2,7 +2,44 @@
 #include <tuple>
 #include <algorithm>
 #include <SDL.h>
-#include <list>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DRAW_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define DRAW_SSSE3 1
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define DRAW_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <cerrno>
+#include <csignal>
+#endif
 
 
 struct coordinate {
@@ -13,27 +50,347 @@ struct line {
 	coordinate start, end;
 };
 
-bool checkInBounds(const coordinate &a, SDL_Surface* surface) {
-	if (a.x > 0 && a.y > 0 && a.x <= surface->w && a.y <= surface->h) {
+// // PIXEL FORMATS // //
+
+enum class pixelFormat { argb8888, rgb565, rgb24, index8 };
+
+// Each format trait packs an ARGB8888 color into the stored value once per call, and stores and
+// loads it bytes at a time. Colors drawn into index8 canvases are palette indices in the low byte.
+struct formatARGB8888 {
+	typedef std::uint32_t packed;
+	static const int bytes = 4;
+	static constexpr packed pack(std::uint32_t color) { return color; }
+	static void store(std::uint8_t* pixel, packed value) { *reinterpret_cast<std::uint32_t*>(pixel) = value; }
+	static packed load(const std::uint8_t* pixel) { return *reinterpret_cast<const std::uint32_t*>(pixel); }
+};
+
+struct formatRGB565 {
+	typedef std::uint16_t packed;
+	static const int bytes = 2;
+	static constexpr packed pack(std::uint32_t color) {
+		return static_cast<packed>(((color >> 8) & 0xF800) | ((color >> 5) & 0x07E0) | ((color >> 3) & 0x001F));
+	}
+	static void store(std::uint8_t* pixel, packed value) { *reinterpret_cast<std::uint16_t*>(pixel) = value; }
+	static packed load(const std::uint8_t* pixel) { return *reinterpret_cast<const std::uint16_t*>(pixel); }
+};
+
+// Red, green, blue in memory order, like SDL_PIXELFORMAT_RGB24.
+struct formatRGB24 {
+	typedef std::uint32_t packed;
+	static const int bytes = 3;
+	static constexpr packed pack(std::uint32_t color) { return color & 0x00FFFFFF; }
+	static void store(std::uint8_t* pixel, packed value) {
+		pixel[0] = static_cast<std::uint8_t>(value >> 16);
+		pixel[1] = static_cast<std::uint8_t>(value >> 8);
+		pixel[2] = static_cast<std::uint8_t>(value);
+	}
+	static packed load(const std::uint8_t* pixel) { return (pixel[0] << 16) | (pixel[1] << 8) | pixel[2]; }
+};
+
+struct formatIndex8 {
+	typedef std::uint8_t packed;
+	static const int bytes = 1;
+	static constexpr packed pack(std::uint32_t color) { return static_cast<packed>(color & 0xFF); }
+	static void store(std::uint8_t* pixel, packed value) { *pixel = value; }
+	static packed load(const std::uint8_t* pixel) { return *pixel; }
+};
+
+int bytesPerPixel(pixelFormat format) {
+	switch (format) {
+	case pixelFormat::rgb565: return formatRGB565::bytes;
+	case pixelFormat::rgb24: return formatRGB24::bytes;
+	case pixelFormat::index8: return formatIndex8::bytes;
+	default: return formatARGB8888::bytes;
+	}
+}
+
+// Calls function with the trait for format, so a templated kernel is picked once per call.
+template <typename Function>
+void withPixelFormat(pixelFormat format, Function function) {
+	switch (format) {
+	case pixelFormat::argb8888: function(formatARGB8888()); break;
+	case pixelFormat::rgb565: function(formatRGB565()); break;
+	case pixelFormat::rgb24: function(formatRGB24()); break;
+	case pixelFormat::index8: function(formatIndex8()); break;
+	}
+}
+
+// Maps an SDL pixel format onto one the kernels can draw. Returns false for formats they can't.
+bool pixelFormatFromSDL(Uint32 sdlFormat, pixelFormat &format) {
+	switch (sdlFormat) {
+	case SDL_PIXELFORMAT_ARGB8888:
+	case SDL_PIXELFORMAT_RGB888: format = pixelFormat::argb8888; return true;
+	case SDL_PIXELFORMAT_RGB565: format = pixelFormat::rgb565; return true;
+	case SDL_PIXELFORMAT_RGB24: format = pixelFormat::rgb24; return true;
+	case SDL_PIXELFORMAT_INDEX8: format = pixelFormat::index8; return true;
+	default: return false;
+	}
+}
+
+Uint32 pixelFormatToSDL(pixelFormat format) {
+	switch (format) {
+	case pixelFormat::rgb565: return SDL_PIXELFORMAT_RGB565;
+	case pixelFormat::rgb24: return SDL_PIXELFORMAT_RGB24;
+	case pixelFormat::index8: return SDL_PIXELFORMAT_INDEX8;
+	default: return SDL_PIXELFORMAT_ARGB8888;
+	}
+}
+
+
+// // CANVAS // //
+
+// Areas of a canvas drawn since the last present. Rectangles that overlap or touch are merged, and
+// once the list is full a new rectangle is merged into the one it grows least, so presenting never
+// takes more than maxRects rectangles.
+struct damageTracker {
+	static const int maxRects = 16;
+	SDL_Rect rects[maxRects];
+	int numRects = 0;
+
+	void add(SDL_Rect rect) {
+		if (rect.w <= 0 || rect.h <= 0) return;
+		// A merged rectangle can reach ones it missed before, so start over after every merge.
+		for (int i = 0; i < numRects;) {
+			if (rect.x <= rects[i].x + rects[i].w && rects[i].x <= rect.x + rect.w &&
+				rect.y <= rects[i].y + rects[i].h && rects[i].y <= rect.y + rect.h) {
+				SDL_UnionRect(&rects[i], &rect, &rect);
+				rects[i] = rects[--numRects];
+				i = 0;
+			}
+			else ++i;
+		}
+		if (numRects == maxRects) {
+			int best = 0;
+			long long bestGrowth = std::numeric_limits<long long>::max();
+			for (int i = 0; i < numRects; ++i) {
+				SDL_Rect merged;
+				SDL_UnionRect(&rects[i], &rect, &merged);
+				const long long growth = static_cast<long long>(merged.w) * merged.h - static_cast<long long>(rects[i].w) * rects[i].h;
+				if (growth < bestGrowth) {
+					best = i;
+					bestGrowth = growth;
+				}
+			}
+			SDL_UnionRect(&rects[best], &rect, &rect);
+			rects[best] = rects[--numRects];
+			add(rect);
+			return;
+		}
+		rects[numRects++] = rect;
+	}
+
+	void clear() { numRects = 0; }
+};
+
+// A view of pixels that all drawing functions target. pitch is in bytes, like SDL_Surface,
+// so padded rows and buffers allocated elsewhere can be drawn into without copying.
+struct canvas {
+	std::uint8_t* pixels;
+	int width, height;
+	int pitch;
+	pixelFormat format;
+	SDL_Rect clip;    // drawing is limited to this rectangle
+	void* memory;     // allocation owned by the canvas, nullptr when wrapping foreign pixels
+	damageTracker* damage; // records the areas drawn, unless nullptr
+};
+
+// Rows of canvases from createCanvas start on a cache line, so span fills can use aligned vector stores.
+const int canvasRowAlignment = 64;
+
+canvas canvasFromPixels(void* pixels, int width, int height, int pitch, pixelFormat format = pixelFormat::argb8888) {
+	canvas target;
+	target.pixels = static_cast<std::uint8_t*>(pixels);
+	target.width = width;
+	target.height = height;
+	target.pitch = pitch;
+	target.format = format;
+	target.clip = { 0, 0, width, height };
+	target.memory = nullptr;
+	target.damage = nullptr;
+	return target;
+}
+
+// Wraps the pixels of surface. Surfaces in formats the kernels can't draw give an empty canvas.
+canvas canvasFromSurface(SDL_Surface* surface) {
+	pixelFormat format;
+	if (!pixelFormatFromSDL(surface->format->format, format)) {
+		SDL_SetError("Unsupported pixel format %s", SDL_GetPixelFormatName(surface->format->format));
+		return canvasFromPixels(nullptr, 0, 0, 0);
+	}
+	canvas target = canvasFromPixels(surface->pixels, surface->w, surface->h, surface->pitch, format);
+	target.clip = surface->clip_rect;
+	return target;
+}
+
+// Allocates a canvas with each row padded to canvasRowAlignment bytes. Free it with destroyCanvas.
+// Returns a canvas without pixels, with the SDL error set, when the size is negative, when a row
+// doesn't fit the int pitch or when the whole canvas doesn't fit in memory.
+canvas createCanvas(int width, int height, pixelFormat format = pixelFormat::argb8888) {
+	const std::uint64_t rowBytes = (static_cast<std::uint64_t>(width) * bytesPerPixel(format) + canvasRowAlignment - 1) & ~std::uint64_t(canvasRowAlignment - 1);
+	if (width < 0 || height < 0 || rowBytes > static_cast<std::uint64_t>(std::numeric_limits<int>::max())
+		|| rowBytes * height > std::numeric_limits<std::size_t>::max() - canvasRowAlignment) {
+		SDL_SetError("Can't allocate a %dx%d canvas", width, height);
+		return canvasFromPixels(nullptr, 0, 0, 0);
+	}
+	const int pitch = static_cast<int>(rowBytes);
+	void* memory = std::malloc(static_cast<std::size_t>(rowBytes * height) + canvasRowAlignment);
+	if (memory == nullptr) {
+		SDL_SetError("Out of memory for a %dx%d canvas", width, height);
+		return canvasFromPixels(nullptr, 0, 0, 0);
+	}
+	const std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(memory) + canvasRowAlignment - 1) & ~std::uintptr_t(canvasRowAlignment - 1);
+	canvas target = canvasFromPixels(reinterpret_cast<void*>(aligned), width, height, pitch, format);
+	target.memory = memory;
+	return target;
+}
+
+void destroyCanvas(canvas &target) {
+	std::free(target.memory);
+	target = canvasFromPixels(nullptr, 0, 0, 0);
+}
+
+// Wraps the pixels of source in an SDL surface without copying them, so canvases drawn without a
+// window can be saved with SDL_SaveBMP or blitted.
+// Free the surface with SDL_FreeSurface before destroying the canvas.
+SDL_Surface* surfaceFromCanvas(const canvas &source) {
+	int bits;
+	Uint32 red, green, blue, alpha;
+	if (!SDL_PixelFormatEnumToMasks(pixelFormatToSDL(source.format), &bits, &red, &green, &blue, &alpha)) return nullptr;
+	SDL_Surface* surface = SDL_CreateRGBSurfaceFrom(source.pixels, source.width, source.height, bits, source.pitch, red, green, blue, alpha);
+	if (surface != nullptr) SDL_SetClipRect(surface, &source.clip);
+	return surface;
+}
+
+// Makes SDL use its dummy video driver, whose windows are plain memory surfaces. Call before SDL_Init;
+// a driver already chosen through SDL_VIDEODRIVER is kept.
+void useHeadlessVideo() {
+	SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+}
+
+bool checkInBounds(const coordinate &a, const canvas &target) {
+	const SDL_Rect &clip = target.clip;
+	if (a.x >= clip.x && a.y >= clip.y && a.x < clip.x + clip.w && a.y < clip.y + clip.h) {
 		return true;
 	}
 	else return false;
 }
 
+// Records rect, limited to the clip rect, as drawn on canvases that track damage.
+void damageRect(SDL_Rect rect, const canvas &target) {
+	if (target.damage == nullptr || !SDL_IntersectRect(&rect, &target.clip, &rect)) return;
+	target.damage->add(rect);
+}
+
+// Records the bounding box of lineA, widened by grow pixels on every side.
+void damageLine(const line &lineA, int grow, const canvas &target) {
+	if (target.damage == nullptr) return;
+	SDL_Rect rect;
+	rect.x = std::min(lineA.start.x, lineA.end.x) - grow;
+	rect.y = std::min(lineA.start.y, lineA.end.y) - grow;
+	rect.w = std::abs(lineA.end.x - lineA.start.x) + 1 + 2 * grow;
+	rect.h = std::abs(lineA.end.y - lineA.start.y) + 1 + 2 * grow;
+	damageRect(rect, target);
+}
+
+// Address of a pixel, using the canvas pitch. Does not check bounds.
+template <typename Format>
+std::uint8_t* pixelAddress(const coordinate &coordA, const canvas &target) {
+	return target.pixels + static_cast<std::ptrdiff_t>(coordA.y) * target.pitch + coordA.x * Format::bytes;
+}
+
+// // DIAGNOSTICS // //
+
+// Totals kept by the drawing functions. Lines are counted once per call, whichever engine draws
+// them, and thick and antialiased lines count as lines too; pixelsDrawn includes the pixels of lines
+// and fills.
+struct drawStats {
+	std::uint64_t pixelsDrawn, pixelsRejected;
+	std::uint64_t linesDrawn, linesRejected, linesClipped;
+};
+
+// Counters are only ever added to with relaxed atomics, so any thread can draw and none waits on I/O.
+struct drawCounters {
+	std::atomic<std::uint64_t> pixelsDrawn, pixelsRejected;
+	std::atomic<std::uint64_t> linesDrawn, linesRejected, linesClipped;
+};
+static drawCounters s_drawCounters;
+
+// Milliseconds between log messages about rejected draws, 0 for no logging.
+static std::atomic<Uint32> s_drawLogInterval(0);
+static std::atomic<Uint32> s_drawLogLast(0);
+
+drawStats queryDrawStats() {
+	drawStats stats;
+	stats.pixelsDrawn = s_drawCounters.pixelsDrawn.load(std::memory_order_relaxed);
+	stats.pixelsRejected = s_drawCounters.pixelsRejected.load(std::memory_order_relaxed);
+	stats.linesDrawn = s_drawCounters.linesDrawn.load(std::memory_order_relaxed);
+	stats.linesRejected = s_drawCounters.linesRejected.load(std::memory_order_relaxed);
+	stats.linesClipped = s_drawCounters.linesClipped.load(std::memory_order_relaxed);
+	return stats;
+}
+
+// Zeroes the counters and returns what they held.
+drawStats resetDrawStats() {
+	drawStats stats;
+	stats.pixelsDrawn = s_drawCounters.pixelsDrawn.exchange(0, std::memory_order_relaxed);
+	stats.pixelsRejected = s_drawCounters.pixelsRejected.exchange(0, std::memory_order_relaxed);
+	stats.linesDrawn = s_drawCounters.linesDrawn.exchange(0, std::memory_order_relaxed);
+	stats.linesRejected = s_drawCounters.linesRejected.exchange(0, std::memory_order_relaxed);
+	stats.linesClipped = s_drawCounters.linesClipped.exchange(0, std::memory_order_relaxed);
+	return stats;
+}
+
+void setDrawLogInterval(Uint32 milliseconds) {
+	s_drawLogInterval.store(milliseconds, std::memory_order_relaxed);
+}
+
+// Called on rejection. Logs the counters at most once per interval, from whichever thread gets there first.
+void logDrawStats() {
+	const Uint32 interval = s_drawLogInterval.load(std::memory_order_relaxed);
+	if (interval == 0) return;
+	const Uint32 now = SDL_GetTicks();
+	Uint32 last = s_drawLogLast.load(std::memory_order_relaxed);
+	if (now - last < interval || !s_drawLogLast.compare_exchange_strong(last, now, std::memory_order_relaxed)) return;
+	const drawStats stats = queryDrawStats();
+	SDL_Log("Draw stats: %llu pixels drawn, %llu rejected; %llu lines drawn, %llu rejected, %llu clipped",
+		static_cast<unsigned long long>(stats.pixelsDrawn), static_cast<unsigned long long>(stats.pixelsRejected),
+		static_cast<unsigned long long>(stats.linesDrawn), static_cast<unsigned long long>(stats.linesRejected),
+		static_cast<unsigned long long>(stats.linesClipped));
+}
+
+// Adds a tally collected locally by a drawing call, skipping counters it didn't touch.
+void addDrawStats(const drawStats &stats) {
+	if (stats.pixelsDrawn) s_drawCounters.pixelsDrawn.fetch_add(stats.pixelsDrawn, std::memory_order_relaxed);
+	if (stats.pixelsRejected) s_drawCounters.pixelsRejected.fetch_add(stats.pixelsRejected, std::memory_order_relaxed);
+	if (stats.linesDrawn) s_drawCounters.linesDrawn.fetch_add(stats.linesDrawn, std::memory_order_relaxed);
+	if (stats.linesRejected) s_drawCounters.linesRejected.fetch_add(stats.linesRejected, std::memory_order_relaxed);
+	if (stats.linesClipped) s_drawCounters.linesClipped.fetch_add(stats.linesClipped, std::memory_order_relaxed);
+	if (stats.pixelsRejected || stats.linesRejected) logDrawStats();
+}
+
 
-void drawPixel(const coordinate &coordA, std::uint32_t color, SDL_Surface* surface) {
-	if (!checkInBounds(coordA, surface)) {
-		std::cout << "Pixel not in bounds" << std::endl;
+void drawPixel(const coordinate &coordA, std::uint32_t color, const canvas &target) {
+	if (!checkInBounds(coordA, target)) {
+		s_drawCounters.pixelsRejected.fetch_add(1, std::memory_order_relaxed);
+		logDrawStats();
 		return;
 	}
-	reinterpret_cast<std::uint32_t*> (surface->pixels)[coordA.x + coordA.y * surface->w] = color;
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		Format::store(pixelAddress<Format>(coordA, target), Format::pack(color));
+	});
+	s_drawCounters.pixelsDrawn.fetch_add(1, std::memory_order_relaxed);
+	if (target.damage) target.damage->add({ coordA.x, coordA.y, 1, 1 });
 }
 
-void drawLine(const line &lineA, std::uint32_t color, SDL_Surface* surface) {
-	if (!checkInBounds(lineA.start, surface) || !checkInBounds(lineA.end, surface)) {
-		std::cout << "Line not in bounds" << std::endl;
+void drawLineReference(const line &lineA, std::uint32_t color, const canvas &target) {
+	if (!checkInBounds(lineA.start, target) || !checkInBounds(lineA.end, target)) {
+		s_drawCounters.linesRejected.fetch_add(1, std::memory_order_relaxed);
+		logDrawStats();
 		return;
 	}
+	s_drawCounters.linesDrawn.fetch_add(1, std::memory_order_relaxed);
+	damageLine(lineA, 0, target);
 
 	// // INITIALIZE VARIABLES
 	coordinate drawCoord;
@@ -49,7 +406,7 @@ void drawLine(const line &lineA, std::uint32_t color, SDL_Surface* surface) {
 	
 	// // CASE WHERE LINE IS POINT
 	if (deltaX == 0 && deltaY == 0) { 
-		drawPixel(drawCoord, color, surface);
+		drawPixel(drawCoord, color, target);
 		return;
 	}
 
@@ -59,7 +416,7 @@ void drawLine(const line &lineA, std::uint32_t color, SDL_Surface* surface) {
 			drawCoord.y = lineA.end.y;
 		}
 		for (i = 0; i < abs(deltaY); ++i) {
-			drawPixel(drawCoord, color, surface);
+			drawPixel(drawCoord, color, target);
 			drawCoord.y = drawCoord.y + 1;
 		}
 		return;
@@ -97,7 +454,7 @@ void drawLine(const line &lineA, std::uint32_t color, SDL_Surface* surface) {
 		drawCoord.y = driving;
 		if (!flipped) std::swap(drawCoord.x, drawCoord.y);
 
-		drawPixel(drawCoord, color, surface);
+		drawPixel(drawCoord, color, target);
 
 		if (e >= 0) {
 			passive += pInc;
@@ -108,67 +465,3478 @@ void drawLine(const line &lineA, std::uint32_t color, SDL_Surface* surface) {
 	}
 }
 
-int main(int, char**) {
-	SDL_Init(SDL_INIT_EVERYTHING);
-	std::atexit(&SDL_Quit);
+// // SPAN FILLS // //
 
+#if DRAW_SSE2
+inline __m128i splat(std::uint32_t value) { return _mm_set1_epi32(static_cast<int>(value)); }
+inline __m128i splat(std::uint16_t value) { return _mm_set1_epi16(static_cast<short>(value)); }
+inline __m128i splat(std::uint8_t value) { return _mm_set1_epi8(static_cast<char>(value)); }
+#endif
+#if DRAW_AVX2
+inline __m256i splatWide(std::uint32_t value) { return _mm256_set1_epi32(static_cast<int>(value)); }
+inline __m256i splatWide(std::uint16_t value) { return _mm256_set1_epi16(static_cast<short>(value)); }
+inline __m256i splatWide(std::uint8_t value) { return _mm256_set1_epi8(static_cast<char>(value)); }
+#endif
 
+// Fills count pixels of type Pixel to the right of pixel. Stores single pixels until pixel is vector
+// aligned, then whole vectors, then the remaining tail.
+template <typename Pixel>
+void fillSpanWords(Pixel* pixel, int count, Pixel value) {
+#if DRAW_AVX2
+	const std::uintptr_t vectorMask = 31;
+#elif DRAW_SSE2
+	const std::uintptr_t vectorMask = 15;
+#else
+	const std::uintptr_t vectorMask = 0;
+#endif
+	while (count > 0 && (reinterpret_cast<std::uintptr_t>(pixel) & vectorMask) != 0) {
+		*pixel++ = value;
+		--count;
+	}
+#if DRAW_AVX2
+	const int widePixels = 32 / sizeof(Pixel);
+	const __m256i wide = splatWide(value);
+	for (; count >= widePixels; count -= widePixels, pixel += widePixels) {
+		_mm256_store_si256(reinterpret_cast<__m256i*>(pixel), wide);
+	}
+#endif
+#if DRAW_SSE2
+	const int vectorPixels = 16 / sizeof(Pixel);
+	const __m128i vector = splat(value);
+	for (; count >= vectorPixels; count -= vectorPixels, pixel += vectorPixels) {
+		_mm_store_si128(reinterpret_cast<__m128i*>(pixel), vector);
+	}
+#endif
+	while (count-- > 0) *pixel++ = value;
+}
 
+// Fills count pixels to the right of pixel.
+template <typename Format>
+void fillSpan(std::uint8_t* pixel, int count, typename Format::packed color) {
+	typedef typename Format::packed Pixel;
+	fillSpanWords(reinterpret_cast<Pixel*>(pixel), count, color);
+}
 
-	auto s_window = SDL_CreateWindow("Fuck me", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280u, 720u, 0u);
-	auto s_surface = SDL_GetWindowSurface(s_window);
-	SDL_FillRect(s_surface, nullptr, 0xFFFFFFFF);
+// Three byte pixels repeat every four pixels, so whole groups are stored as three 32-bit words.
+template <>
+void fillSpan<formatRGB24>(std::uint8_t* pixel, int count, formatRGB24::packed color) {
+	std::uint8_t group[12];
+	for (int i = 0; i < 4; ++i) formatRGB24::store(group + 3 * i, color);
+	for (; count >= 4; count -= 4, pixel += 12) {
+		std::memcpy(pixel, group, sizeof(group));
+	}
+	for (; count > 0; --count, pixel += 3) {
+		formatRGB24::store(pixel, color);
+	}
+}
 
-	SDL_Event s_event;
-	auto s_last_x = 0;
-	auto s_last_y = 0;
-	auto s_size = 0;
+// Fills count pixels downwards from pixel, stepping by pitch bytes.
+template <typename Format>
+void fillColumn(std::uint8_t* pixel, int count, std::ptrdiff_t pitch, typename Format::packed color) {
+	for (int i = 0; i < count; ++i, pixel += pitch) {
+		Format::store(pixel, color);
+	}
+}
 
+// Fills rect, limited to the clip rect, one span per row.
+void fillRect(SDL_Rect rect, std::uint32_t color, const canvas &target) {
+	drawStats stats = {};
+	const std::uint64_t requested = rect.w > 0 && rect.h > 0 ? static_cast<std::uint64_t>(rect.w) * rect.h : 0;
+	if (!SDL_IntersectRect(&rect, &target.clip, &rect)) {
+		stats.pixelsRejected = requested;
+		addDrawStats(stats);
+		return;
+	}
+	stats.pixelsDrawn = static_cast<std::uint64_t>(rect.w) * rect.h;
+	stats.pixelsRejected = requested - stats.pixelsDrawn;
+	addDrawStats(stats);
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		const typename Format::packed packed = Format::pack(color);
+		for (int row = rect.y; row < rect.y + rect.h; ++row) {
+			fillSpan<Format>(pixelAddress<Format>({ rect.x, row }, target), rect.w, packed);
+		}
+	});
+	damageRect(rect, target);
+}
 
-	// // DEFINE LINE PROPERTIES // //
-	int red = 0xFFFF0000;
 
-	coordinate pixelCoord;
-	pixelCoord.x = 10; pixelCoord.y = 10;
-	drawPixel(pixelCoord, red, s_surface);
+// // LINE CLIPPING // //
 
-	int startX = 300;
-	int startY = 300;
-	int endX[] = { 300, 300, 380 ,450, 480, 500, 480, 450, 380, 300, 220, 150, 120, 100, 120, 150, 200 };
-	int endY[] = { 300, 100, 130 ,150, 220, 300, 380, 450, 480, 500, 480, 450, 390, 300, 220, 150, 130 };
-	int numLines = sizeof(endX) / sizeof(endX[0]);
+enum outCodeBits { outLeft = 1, outRight = 2, outTop = 4, outBottom = 8 };
 
+int outCode(const coordinate &a, const SDL_Rect &clip) {
+	return (a.x < clip.x ? outLeft : 0) | (a.x >= clip.x + clip.w ? outRight : 0) |
+		(a.y < clip.y ? outTop : 0) | (a.y >= clip.y + clip.h ? outBottom : 0);
+}
 
-	// // CREATE LINE DATA STRUCTURES // //
-	std::list<line> lines;
-	for (int i = 0; i < numLines; ++i) {
-		coordinate tempStart;
-		coordinate tempEnd;
-		line tempLine;
-		tempStart.x = startX;
-		tempStart.y = startY;
-		tempEnd.x = endX[i];
-		tempEnd.y = endY[i];
-		tempLine.start = tempStart;
-		tempLine.end = tempEnd;
-		lines.push_back(tempLine);
+// A line ready for rasterizing: everything a kernel needs to start drawing at the first visible pixel.
+struct lineSetup {
+	coordinate start;             // first pixel to draw
+	int length;                   // pixels to draw along the driving axis
+	int error;                    // error term at start
+	int twoPassive, twoDriving;   // error increments
+	int octant;                   // bit 2: x is the driving axis, bit 1: x steps -1, bit 0: y steps -1
+	int skipped;                  // steps of the unclipped line before start
+	bool clipped;                 // false when the whole line is visible
+};
+
+// Computes the Bresenham setup for lineA and clips it to clip. Clipping works on the step index along
+// the driving axis, so the pixels drawn are exactly the pixels of the unclipped line that fall inside clip.
+// Returns false when nothing is visible. codeStart and codeEnd are the outcodes of the end points.
+bool setupLine(const line &lineA, const SDL_Rect &clip, int codeStart, int codeEnd, lineSetup &setup) {
+	if (codeStart & codeEnd) return false; // // TRIVIAL REJECT
+
+	const int deltaX = lineA.end.x - lineA.start.x;
+	const int deltaY = lineA.end.y - lineA.start.y;
+	const bool xMajor = std::abs(deltaX) >= std::abs(deltaY);
+	const int driving = xMajor ? std::abs(deltaX) : std::abs(deltaY);
+	const int passive = xMajor ? std::abs(deltaY) : std::abs(deltaX);
+	setup.octant = (xMajor ? 4 : 0) | (deltaX < 0 ? 2 : 0) | (deltaY < 0 ? 1 : 0);
+	setup.twoPassive = 2 * passive;
+	setup.twoDriving = 2 * driving;
+
+	// // CASE WHERE LINE IS POINT
+	if (driving == 0) {
+		setup.start = lineA.start;
+		setup.length = 1;
+		setup.error = 0;
+		setup.skipped = 0;
+		setup.clipped = false;
+		return codeStart == 0;
 	}
 
-	// // DRAW LINES // //
-	auto it = lines.begin();
-	while (it != lines.end()) {
-		drawLine(*it, red, s_surface);
-		it++;
+	// // TRIVIAL ACCEPT. Like the reference line, the end point is not drawn.
+	if ((codeStart | codeEnd) == 0) {
+		setup.start = lineA.start;
+		setup.length = driving;
+		setup.error = 2 * passive - driving;
+		setup.skipped = 0;
+		setup.clipped = false;
+		return true;
+	}
+
+	// Step k is drawn at driving0 + driveStep * k, passive0 + passStep * floor((2 * passive * k + driving) / (2 * driving)).
+	const int driving0 = xMajor ? lineA.start.x : lineA.start.y;
+	const int passive0 = xMajor ? lineA.start.y : lineA.start.x;
+	const int driveStep = (xMajor ? deltaX : deltaY) < 0 ? -1 : 1;
+	const int passStep = (xMajor ? deltaY : deltaX) < 0 ? -1 : 1;
+	const int driveMin = xMajor ? clip.x : clip.y;
+	const int driveMax = driveMin + (xMajor ? clip.w : clip.h) - 1;
+	const int passMin = xMajor ? clip.y : clip.x;
+	const int passMax = passMin + (xMajor ? clip.h : clip.w) - 1;
+
+	long long first = 0, last = driving - 1;
+
+	// Driving axis range is linear in k.
+	first = std::max<long long>(first, driveStep > 0 ? driveMin - driving0 : driving0 - driveMax);
+	last = std::min<long long>(last, driveStep > 0 ? driveMax - driving0 : driving0 - driveMin);
+
+	// Passive axis offset must lie in [offsetMin, offsetMax].
+	const long long offsetMin = passStep > 0 ? passMin - passive0 : passive0 - passMax;
+	const long long offsetMax = passStep > 0 ? passMax - passive0 : passive0 - passMin;
+	if (offsetMax < 0) return false;
+	if (offsetMin > 0) {
+		if (passive == 0) return false;
+		const long long numerator = 2LL * driving * offsetMin - driving;
+		first = std::max(first, (numerator + 2LL * passive - 1) / (2LL * passive));
+	}
+	if (passive != 0) {
+		last = std::min(last, (2LL * driving * (offsetMax + 1) - driving - 1) / (2LL * passive));
+	}
+	if (first > last) return false;
+
+	const long long offset = (2LL * passive * first + driving) / (2LL * driving);
+	const int drawDriving = driving0 + driveStep * static_cast<int>(first);
+	const int drawPassive = passive0 + passStep * static_cast<int>(offset);
+	setup.start.x = xMajor ? drawDriving : drawPassive;
+	setup.start.y = xMajor ? drawPassive : drawDriving;
+	setup.length = static_cast<int>(last - first + 1);
+	setup.error = static_cast<int>(2LL * passive * (first + 1) - driving - 2LL * driving * offset);
+	setup.skipped = static_cast<int>(first);
+	setup.clipped = true;
+	return true;
+}
+
+bool setupLine(const line &lineA, const SDL_Rect &clip, lineSetup &setup) {
+	return setupLine(lineA, clip, outCode(lineA.start, clip), outCode(lineA.end, clip), setup);
+}
+
+// Adds a line that went through setupLine to a local tally.
+inline void countLine(bool visible, const lineSetup &setup, drawStats &stats) {
+	if (!visible) {
+		++stats.linesRejected;
+		return;
+	}
+	++stats.linesDrawn;
+	stats.linesClipped += setup.clipped;
+	stats.pixelsDrawn += setup.length;
+}
+
+
+// // INTEGER BRESENHAM LINE ENGINE // //
+
+enum class lineEngine { reference, bresenham, runSlice };
+static lineEngine s_lineEngine = lineEngine::bresenham;
+
+// Draws one octant with an all-integer error term. XMajor picks the driving axis, DriveStep
+// and PassStep are the +1/-1 steps on the driving and passive axes, so the loop has no branches.
+// The line must already be clipped: pixels are written through the pointer without bounds checks.
+template <typename Format, bool XMajor, int DriveStep, int PassStep>
+void bresenhamOctant(std::uint8_t* pixel, std::ptrdiff_t pitch, int length, int error, int twoPassive, int twoDriving, typename Format::packed color) {
+	const std::ptrdiff_t driveDelta = XMajor ? DriveStep * Format::bytes : DriveStep * pitch;
+	const std::ptrdiff_t passDelta = XMajor ? PassStep * pitch : PassStep * Format::bytes;
+	for (int i = 0; i < length; ++i) {
+		Format::store(pixel, color);
+		const int carry = -(error >= 0); // all ones when the passive axis steps
+		pixel += driveDelta + (passDelta & carry);
+		error += twoPassive - (twoDriving & carry);
+	}
+}
+
+template <typename Format>
+void rasterizeBresenham(const lineSetup &setup, typename Format::packed color, const canvas &target) {
+	// Bounds were settled by the clipper, so the kernels just walk a pointer.
+	std::uint8_t* pixel = pixelAddress<Format>(setup.start, target);
+	const std::ptrdiff_t pitch = target.pitch;
+
+	// // CASE WHERE LINE IS HORIZONTAL OR VERTICAL. Spans are filled left to right and top to bottom.
+	if (setup.twoPassive == 0) {
+		const bool backwards = (setup.octant & (setup.octant & 4 ? 2 : 1)) != 0;
+		if (setup.octant & 4) {
+			fillSpan<Format>(backwards ? pixel - (setup.length - 1) * Format::bytes : pixel, setup.length, color);
+		}
+		else {
+			fillColumn<Format>(backwards ? pixel - (setup.length - 1) * pitch : pixel, setup.length, pitch, color);
+		}
+		return;
+	}
+
+	const int twoPassive = setup.twoPassive, twoDriving = setup.twoDriving;
+	switch (setup.octant) {
+	case 0: bresenhamOctant<Format, false,  1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 1: bresenhamOctant<Format, false, -1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 2: bresenhamOctant<Format, false,  1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 3: bresenhamOctant<Format, false, -1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 4: bresenhamOctant<Format, true,   1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 5: bresenhamOctant<Format, true,   1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 6: bresenhamOctant<Format, true,  -1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 7: bresenhamOctant<Format, true,  -1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	}
+}
+
+template <typename Format>
+void drawLineBresenham(const line &lineA, typename Format::packed color, const canvas &target) {
+	lineSetup setup;
+	drawStats stats = {};
+	const bool visible = setupLine(lineA, target.clip, setup);
+	if (visible) {
+		rasterizeBresenham<Format>(setup, color, target);
+		damageLine(lineA, 0, target);
+	}
+	countLine(visible, setup, stats);
+	addDrawStats(stats);
+}
+
+
+// // RUN-SLICE LINE ENGINE // //
+
+// Lines at least this many times longer on the driving axis than on the passive axis are drawn as runs.
+const int runSliceMinRatio = 2;
+
+// Draws one octant as runs of pixels that share a passive coordinate. The first run length takes one
+// division; after that every run is either wholeRun or wholeRun + 1 pixels long, decided by a
+// remainder that advances like a Bresenham error term. Runs along x are filled with fillSpan.
+template <typename Format, bool XMajor, int DriveStep, int PassStep>
+void runSliceOctant(std::uint8_t* pixel, std::ptrdiff_t pitch, int length, int error, int twoPassive, int twoDriving, typename Format::packed color) {
+	const std::ptrdiff_t driveDelta = XMajor ? DriveStep * Format::bytes : DriveStep * pitch;
+	const std::ptrdiff_t passDelta = XMajor ? PassStep * pitch : PassStep * Format::bytes;
+	const int wholeRun = twoDriving / twoPassive;
+	const int extra = twoDriving % twoPassive;
+
+	// The first run ends at the first step where the error becomes non-negative.
+	int steps = error >= 0 ? 0 : (twoPassive - 1 - error) / twoPassive;
+	int run = steps + 1;
+	int remainder = error + twoPassive * steps;
+
+	while (length > 0) {
+		run = std::min(run, length);
+		std::uint8_t* first = DriveStep > 0 ? pixel : pixel + (run - 1) * driveDelta;
+		if (XMajor) fillSpan<Format>(first, run, color);
+		else fillColumn<Format>(first, run, pitch, color);
+		pixel += run * driveDelta + passDelta;
+		length -= run;
+
+		const int longer = -(remainder < extra);
+		run = wholeRun - longer;
+		remainder += (twoPassive & longer) - extra;
+	}
+}
+
+template <typename Format>
+void rasterizeRunSlice(const lineSetup &setup, typename Format::packed color, const canvas &target) {
+	if (setup.twoPassive == 0 || setup.twoDriving < runSliceMinRatio * setup.twoPassive) {
+		rasterizeBresenham<Format>(setup, color, target);
+		return;
+	}
+
+	std::uint8_t* pixel = pixelAddress<Format>(setup.start, target);
+	const std::ptrdiff_t pitch = target.pitch;
+	const int twoPassive = setup.twoPassive, twoDriving = setup.twoDriving;
+	switch (setup.octant) {
+	case 0: runSliceOctant<Format, false,  1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 1: runSliceOctant<Format, false, -1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 2: runSliceOctant<Format, false,  1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 3: runSliceOctant<Format, false, -1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 4: runSliceOctant<Format, true,   1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 5: runSliceOctant<Format, true,   1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 6: runSliceOctant<Format, true,  -1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	case 7: runSliceOctant<Format, true,  -1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, color); break;
+	}
+}
+
+template <typename Format>
+void drawLineRunSlice(const line &lineA, typename Format::packed color, const canvas &target) {
+	lineSetup setup;
+	drawStats stats = {};
+	const bool visible = setupLine(lineA, target.clip, setup);
+	if (visible) {
+		rasterizeRunSlice<Format>(setup, color, target);
+		damageLine(lineA, 0, target);
+	}
+	countLine(visible, setup, stats);
+	addDrawStats(stats);
+}
+
+void drawLine(const line &lineA, std::uint32_t color, const canvas &target) {
+	if (s_lineEngine == lineEngine::reference) {
+		drawLineReference(lineA, color, target);
+		return;
+	}
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		if (s_lineEngine == lineEngine::runSlice) drawLineRunSlice<Format>(lineA, Format::pack(color), target);
+		else drawLineBresenham<Format>(lineA, Format::pack(color), target);
+	});
+}
+
+
+// // PATTERNED LINES // //
+
+// On/off pattern for dashed and stippled lines. Bit 0 of mask covers the first scale steps of a line,
+// bit 1 the next scale steps and so on, repeating every 64 * scale steps. Set bits are drawn.
+struct linePattern {
+	std::uint64_t mask;
+	int scale;
+};
+
+// Pattern from a 32-bit mask, repeated into both halves of the 64-bit one.
+linePattern linePattern32(std::uint32_t mask, int scale = 1) {
+	linePattern pattern = { (static_cast<std::uint64_t>(mask) << 32) | mask, scale };
+	return pattern;
+}
+
+inline std::uint64_t rotateRight(std::uint64_t value, int count) {
+	count &= 63;
+	return count == 0 ? value : (value >> count) | (value << (64 - count));
+}
+
+// Bresenham octant kernel that also walks a pattern. Bit 0 of mask is the current step's bit; run
+// counts the steps left before the mask rotates to its next bit. Every pixel on the line is written
+// through the mask as read-modify-write, so dashes cost a load and two ands rather than a branch.
+template <typename Format, bool XMajor, int DriveStep, int PassStep>
+void patternOctant(std::uint8_t* pixel, std::ptrdiff_t pitch, int length, int error, int twoPassive, int twoDriving,
+	std::uint64_t mask, int scale, int run, typename Format::packed color) {
+	typedef typename Format::packed packed;
+	const std::ptrdiff_t driveDelta = XMajor ? DriveStep * Format::bytes : DriveStep * pitch;
+	const std::ptrdiff_t passDelta = XMajor ? PassStep * pitch : PassStep * Format::bytes;
+	for (int i = 0; i < length; ++i) {
+		const packed write = static_cast<packed>(0 - static_cast<packed>(mask & 1));
+		Format::store(pixel, static_cast<packed>((Format::load(pixel) & ~write) | (color & write)));
+		const int carry = -(error >= 0);
+		pixel += driveDelta + (passDelta & carry);
+		error += twoPassive - (twoDriving & carry);
+		const bool advance = --run == 0;
+		const std::uint64_t next = 0 - static_cast<std::uint64_t>(advance); // all ones when the pattern moves to its next bit
+		mask = (mask & ~next) | (rotateRight(mask, 1) & next);
+		run += scale & -static_cast<int>(advance);
+	}
+}
+
+template <typename Format>
+void rasterizePattern(const lineSetup &setup, const linePattern &pattern, typename Format::packed color, const canvas &target) {
+	// Start the pattern where the unclipped line would be at the first visible pixel.
+	const int scale = std::max(pattern.scale, 1);
+	const std::uint64_t mask = rotateRight(pattern.mask, (setup.skipped / scale) & 63);
+	const int run = scale - setup.skipped % scale;
+
+	std::uint8_t* pixel = pixelAddress<Format>(setup.start, target);
+	const std::ptrdiff_t pitch = target.pitch;
+	const int twoPassive = setup.twoPassive, twoDriving = setup.twoDriving;
+	switch (setup.octant) {
+	case 0: patternOctant<Format, false,  1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, mask, scale, run, color); break;
+	case 1: patternOctant<Format, false, -1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, mask, scale, run, color); break;
+	case 2: patternOctant<Format, false,  1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, mask, scale, run, color); break;
+	case 3: patternOctant<Format, false, -1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, mask, scale, run, color); break;
+	case 4: patternOctant<Format, true,   1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, mask, scale, run, color); break;
+	case 5: patternOctant<Format, true,   1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, mask, scale, run, color); break;
+	case 6: patternOctant<Format, true,  -1,  1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, mask, scale, run, color); break;
+	case 7: patternOctant<Format, true,  -1, -1>(pixel, pitch, setup.length, setup.error, twoPassive, twoDriving, mask, scale, run, color); break;
 	}
+}
+
+// Draws lineA with pattern applied from its start point. Clipping keeps the pattern's phase, so a
+// clipped dashed line shows the same dashes as the unclipped one.
+void drawLine(const line &lineA, const linePattern &pattern, std::uint32_t color, const canvas &target) {
+	lineSetup setup;
+	drawStats stats = {};
+	const bool visible = setupLine(lineA, target.clip, setup);
+	countLine(visible, setup, stats);
+	addDrawStats(stats);
+	if (!visible) return;
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		rasterizePattern<Format>(setup, pattern, Format::pack(color), target);
+	});
+	damageLine(lineA, 0, target);
+}
+
+
+// // LINE BUFFER // //
+
+// Lines stored as a structure of arrays, so batch passes stream through each coordinate and can
+// test several lines per vector. color is either empty or holds one color per line; once any line has
+// a color, lines pushed without one get defaultColor.
+struct lineBuffer {
+	static const std::uint32_t defaultColor = 0xFF000000;
+	std::vector<int> x0, y0, x1, y1;
+	std::vector<std::uint32_t> color;
+
+	void reserve(std::size_t capacity) {
+		x0.reserve(capacity);
+		y0.reserve(capacity);
+		x1.reserve(capacity);
+		y1.reserve(capacity);
+	}
+
+	void push_back(const line &lineA) {
+		x0.push_back(lineA.start.x);
+		y0.push_back(lineA.start.y);
+		x1.push_back(lineA.end.x);
+		y1.push_back(lineA.end.y);
+		if (!color.empty()) color.push_back(defaultColor);
+	}
+
+	void push_back(const line &lineA, std::uint32_t lineColor) {
+		if (color.capacity() < x0.capacity()) color.reserve(x0.capacity());
+		color.resize(x0.size(), defaultColor);
+		x0.push_back(lineA.start.x);
+		y0.push_back(lineA.start.y);
+		x1.push_back(lineA.end.x);
+		y1.push_back(lineA.end.y);
+		color.push_back(lineColor);
+	}
+
+	line get(std::size_t i) const {
+		line lineA;
+		lineA.start.x = x0[i];
+		lineA.start.y = y0[i];
+		lineA.end.x = x1[i];
+		lineA.end.y = y1[i];
+		return lineA;
+	}
+
+	std::size_t size() const { return x0.size(); }
+
+	void clear() {
+		x0.clear();
+		y0.clear();
+		x1.clear();
+		y1.clear();
+		color.clear();
+	}
+};
+const std::uint32_t lineBuffer::defaultColor;
+
+
+// // ANTIALIASED LINES // //
+
+// Maps 8-bit coverage to a blend weight out of 256, so a full-coverage pixel becomes exactly the line
+// color and blending needs a shift instead of a divide by 255.
+struct blendTable {
+	std::uint16_t weight[256];
+	blendTable() {
+		for (int coverage = 0; coverage < 256; ++coverage) {
+			weight[coverage] = static_cast<std::uint16_t>((coverage * 256 + 127) / 255);
+		}
+	}
+};
+static const blendTable s_blendTable;
+
+// Blends color over a pixel: (pixel * (256 - weight) + color * weight) >> 8 on every channel.
+inline std::uint32_t blendPixel(std::uint32_t pixel, std::uint32_t color, int weight) {
+	std::uint32_t result = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		const std::uint32_t under = (pixel >> shift) & 0xFF, over = (color >> shift) & 0xFF;
+		result |= ((under * (256 - weight) + over * weight) >> 8) << shift;
+	}
+	return result;
+}
+
+// Blends color into the pixel pair of one Wu step as one 2-wide operation: both pixels are unpacked
+// to 16-bit lanes side by side and weighted together. For lines stepping in y the pair is two adjacent
+// pixels, loaded and stored as a single 64-bit word.
+template <bool XMajor>
+inline void blendPair(std::uint32_t* first, std::uint32_t* second, std::uint32_t color, int weightFirst, int weightSecond) {
+#if DRAW_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i pair = XMajor
+		? _mm_unpacklo_epi32(_mm_cvtsi32_si128(static_cast<int>(*first)), _mm_cvtsi32_si128(static_cast<int>(*second)))
+		: _mm_loadl_epi64(reinterpret_cast<const __m128i*>(first));
+	const __m128i under = _mm_unpacklo_epi8(pair, zero);
+	const __m128i over = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(color)), zero);
+	const __m128i weight = _mm_setr_epi16(
+		static_cast<short>(weightFirst), static_cast<short>(weightFirst), static_cast<short>(weightFirst), static_cast<short>(weightFirst),
+		static_cast<short>(weightSecond), static_cast<short>(weightSecond), static_cast<short>(weightSecond), static_cast<short>(weightSecond));
+	const __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(256), weight);
+	// Both products are at most 255 * 256, so the sum fits an unsigned 16-bit lane.
+	const __m128i sum = _mm_add_epi16(_mm_mullo_epi16(under, inverse), _mm_mullo_epi16(over, weight));
+	const __m128i blended = _mm_packus_epi16(_mm_srli_epi16(sum, 8), zero);
+	if (XMajor) {
+		*first = static_cast<std::uint32_t>(_mm_cvtsi128_si32(blended));
+		*second = static_cast<std::uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(blended, 4)));
+	}
+	else {
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(first), blended);
+	}
+#else
+	*first = blendPixel(*first, color, weightFirst);
+	*second = blendPixel(*second, color, weightSecond);
+#endif
+}
 
+// Wu's algorithm: at each driving step the exact passive position, in 32.32 fixed point, is split
+// between the two nearest pixels in proportion to its fraction. Like drawLine, the end point is not drawn.
+// Returns the number of pixels blended.
+template <bool XMajor>
+int wuLine(const line &lineA, std::uint32_t color, const canvas &target) {
+	const int driving0 = XMajor ? lineA.start.x : lineA.start.y;
+	const int passive0 = XMajor ? lineA.start.y : lineA.start.x;
+	const int deltaDriving = XMajor ? lineA.end.x - lineA.start.x : lineA.end.y - lineA.start.y;
+	const int deltaPassive = XMajor ? lineA.end.y - lineA.start.y : lineA.end.x - lineA.start.x;
+	const int driving = std::abs(deltaDriving);
+	const int driveStep = deltaDriving < 0 ? -1 : 1;
+	const int passStep = deltaPassive < 0 ? -1 : 1;
+	const SDL_Rect &clip = target.clip;
+	const int driveMin = XMajor ? clip.x : clip.y;
+	const int driveMax = driveMin + (XMajor ? clip.w : clip.h) - 1;
+	const int passMin = XMajor ? clip.y : clip.x;
+	const int passMax = passMin + (XMajor ? clip.h : clip.w) - 1;
 
+	// // CLIP THE DRIVING AXIS
+	const int first = std::max(0, driveStep > 0 ? driveMin - driving0 : driving0 - driveMax);
+	const int last = std::min(driving - 1, driveStep > 0 ? driveMax - driving0 : driving0 - driveMin);
+	if (first > last) return 0;
 
+	const std::int64_t gradient = (static_cast<std::int64_t>(std::abs(deltaPassive)) << 32) / driving;
+	std::int64_t position = gradient * first;
+	const std::ptrdiff_t pitch = target.pitch / static_cast<int>(sizeof(std::uint32_t));
+	const std::ptrdiff_t passDelta = XMajor ? pitch : 1;
+	int pixels = 0;
+	for (int step = first; step <= last; ++step, position += gradient) {
+		const int whole = static_cast<int>(position >> 32);
+		const int coverage = static_cast<int>((position >> 24) & 0xFF);
+		const int weightNear = s_blendTable.weight[255 - coverage];
+		const int weightFar = s_blendTable.weight[coverage];
 
+		// The pair in increasing address order: low is the pixel with the smaller passive coordinate.
+		const int low = passStep > 0 ? passive0 + whole : passive0 - whole - 1;
+		const int weightLow = passStep > 0 ? weightNear : weightFar;
+		const int weightHigh = passStep > 0 ? weightFar : weightNear;
+		coordinate at;
+		(XMajor ? at.x : at.y) = driving0 + driveStep * step;
+		(XMajor ? at.y : at.x) = low;
+		if (low >= passMin && low < passMax) {
+			std::uint32_t* pixel = reinterpret_cast<std::uint32_t*>(pixelAddress<formatARGB8888>(at, target));
+			blendPair<XMajor>(pixel, pixel + passDelta, color, weightLow, weightHigh);
+			pixels += 2;
+			continue;
+		}
+		// // PAIR STRADDLES THE CLIP EDGE
+		if (low >= passMin && low <= passMax) {
+			std::uint32_t* pixel = reinterpret_cast<std::uint32_t*>(pixelAddress<formatARGB8888>(at, target));
+			*pixel = blendPixel(*pixel, color, weightLow);
+			++pixels;
+		}
+		if (low + 1 >= passMin && low + 1 <= passMax) {
+			(XMajor ? at.y : at.x) = low + 1;
+			std::uint32_t* pixel = reinterpret_cast<std::uint32_t*>(pixelAddress<formatARGB8888>(at, target));
+			*pixel = blendPixel(*pixel, color, weightHigh);
+			++pixels;
+		}
+	}
+	return pixels;
+}
+
+// Draws an antialiased line. Blending needs ARGB8888 pixels, so other canvases get the aliased line,
+// as do horizontal and vertical lines, which Wu's algorithm would draw with full coverage anyway.
+void drawLineAA(const line &lineA, std::uint32_t color, const canvas &target) {
+	const int absX = std::abs(lineA.end.x - lineA.start.x);
+	const int absY = std::abs(lineA.end.y - lineA.start.y);
+	if (target.format != pixelFormat::argb8888 || absX == 0 || absY == 0) {
+		drawLine(lineA, color, target);
+		return;
+	}
+	drawStats stats = {};
+	const int codeStart = outCode(lineA.start, target.clip), codeEnd = outCode(lineA.end, target.clip);
+	const int pixels = codeStart & codeEnd ? 0 : absX >= absY ? wuLine<true>(lineA, color, target) : wuLine<false>(lineA, color, target);
+	if (pixels > 0) {
+		++stats.linesDrawn;
+		stats.linesClipped += (codeStart | codeEnd) != 0;
+		stats.pixelsDrawn += pixels;
+		damageLine(lineA, 1, target);
+	}
+	else ++stats.linesRejected;
+	addDrawStats(stats);
+}
+
+
+// // THICK LINES // //
+
+enum class lineCap { butt, square, round };
+
+// A point in pixel space. Pixel (x, y) covers [x, x + 1) x [y, y + 1), so its center is (x + 0.5, y + 0.5).
+struct vertex {
+	double x, y;
+};
+
+// A convex region: a convex polygon of up to four points joined with up to two discs of the same
+// radius. The discs must lie on the polygon's outline so that the union stays convex, as the caps
+// of a stroke do, so every scanline crosses it in a single span.
+struct convexShape {
+	vertex points[4];
+	int numPoints;
+	vertex centers[2];
+	int numDiscs;
+	double radius;
+};
+
+// Finds where scanline y crosses shape. Returns false when it doesn't.
+bool shapeSpan(const convexShape &shape, double y, double &left, double &right) {
+	left = std::numeric_limits<double>::max();
+	right = std::numeric_limits<double>::lowest();
+	for (int i = 0; i < shape.numPoints; ++i) {
+		const vertex &a = shape.points[i];
+		const vertex &b = shape.points[(i + 1) % shape.numPoints];
+		if ((a.y <= y && y < b.y) || (b.y <= y && y < a.y)) {
+			const double x = a.x + (y - a.y) * (b.x - a.x) / (b.y - a.y);
+			left = std::min(left, x);
+			right = std::max(right, x);
+		}
+	}
+	for (int i = 0; i < shape.numDiscs; ++i) {
+		const double dy = y - shape.centers[i].y;
+		if (std::abs(dy) > shape.radius) continue;
+		const double half = std::sqrt(shape.radius * shape.radius - dy * dy);
+		left = std::min(left, shape.centers[i].x - half);
+		right = std::max(right, shape.centers[i].x + half);
+	}
+	return left <= right;
+}
+
+// Fills every pixel whose center lies in shape, one span per scanline, so no pixel is written twice.
+// Adds the pixels filled to stats and returns whether the clip rect cut the shape.
+template <typename Format>
+bool fillShape(const convexShape &shape, typename Format::packed color, const canvas &target, drawStats &stats) {
+	double top = std::numeric_limits<double>::max(), bottom = std::numeric_limits<double>::lowest();
+	for (int i = 0; i < shape.numPoints; ++i) {
+		top = std::min(top, shape.points[i].y);
+		bottom = std::max(bottom, shape.points[i].y);
+	}
+	for (int i = 0; i < shape.numDiscs; ++i) {
+		top = std::min(top, shape.centers[i].y - shape.radius);
+		bottom = std::max(bottom, shape.centers[i].y + shape.radius);
+	}
+	const SDL_Rect &clip = target.clip;
+	const int topRow = static_cast<int>(std::ceil(top - 0.5)), bottomRow = static_cast<int>(std::ceil(bottom - 0.5));
+	const int firstRow = std::max(clip.y, topRow);
+	const int lastRow = std::min(clip.y + clip.h - 1, bottomRow);
+	bool clipped = firstRow != topRow || lastRow != bottomRow;
+
+	int damageLeft = std::numeric_limits<int>::max(), damageRight = std::numeric_limits<int>::min();
+	for (int row = firstRow; row <= lastRow; ++row) {
+		double left, right;
+		if (!shapeSpan(shape, row + 0.5, left, right)) continue;
+		const int spanLeft = static_cast<int>(std::ceil(left - 0.5)), spanEnd = static_cast<int>(std::ceil(right - 0.5));
+		coordinate first;
+		first.x = std::max(clip.x, spanLeft);
+		first.y = row;
+		const int end = std::min(clip.x + clip.w, spanEnd);
+		if (spanLeft < spanEnd && (first.x != spanLeft || end != spanEnd)) clipped = true;
+		if (end > first.x) {
+			fillSpan<Format>(pixelAddress<Format>(first, target), end - first.x, color);
+			stats.pixelsDrawn += end - first.x;
+			damageLeft = std::min(damageLeft, first.x);
+			damageRight = std::max(damageRight, end);
+		}
+	}
+	if (damageLeft < damageRight) damageRect({ damageLeft, firstRow, damageRight - damageLeft, lastRow - firstRow + 1 }, target);
+	return clipped;
+}
+
+void fillShape(const convexShape &shape, std::uint32_t color, const canvas &target) {
+	drawStats stats = {};
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		fillShape<Format>(shape, Format::pack(color), target, stats);
+	});
+	addDrawStats(stats);
+}
 
-	while (!SDL_QuitRequested()) {
-		SDL_UpdateWindowSurface(s_window);
+// Counts a stroke filled as a shape like a line: rejected when it filled nothing.
+inline void countStroke(std::uint64_t pixels, bool clipped, drawStats &stats) {
+	if (pixels == 0) {
+		++stats.linesRejected;
+		return;
 	}
+	++stats.linesDrawn;
+	stats.linesClipped += clipped;
+}
+
+// Builds the shape of a stroke from pixel center to pixel center: a quad, lengthened by half the width
+// for square caps, or with a disc on each end for round caps.
+convexShape strokeShape(const line &lineA, double width, lineCap cap) {
+	const vertex start = { lineA.start.x + 0.5, lineA.start.y + 0.5 };
+	const vertex end = { lineA.end.x + 0.5, lineA.end.y + 0.5 };
+	const double length = std::hypot(end.x - start.x, end.y - start.y);
+	const double half = width / 2;
+	// Unit direction, and the normal scaled to half the width. Points get the direction of +x.
+	const double dirX = length > 0 ? (end.x - start.x) / length : 1, dirY = length > 0 ? (end.y - start.y) / length : 0;
+	const double normalX = -dirY * half, normalY = dirX * half;
+	const double extend = cap == lineCap::square ? half : 0;
+
+	convexShape shape;
+	shape.points[0] = { start.x - dirX * extend + normalX, start.y - dirY * extend + normalY };
+	shape.points[1] = { end.x + dirX * extend + normalX, end.y + dirY * extend + normalY };
+	shape.points[2] = { end.x + dirX * extend - normalX, end.y + dirY * extend - normalY };
+	shape.points[3] = { start.x - dirX * extend - normalX, start.y - dirY * extend - normalY };
+	shape.numPoints = 4;
+	shape.centers[0] = start;
+	shape.centers[1] = end;
+	shape.numDiscs = cap == lineCap::round ? 2 : 0;
+	shape.radius = half;
+	return shape;
+}
+
+// Draws lineA width pixels wide. Each covered scanline is filled once with a span. Widths of one
+// pixel or less draw the plain drawLine line.
+void drawThickLine(const line &lineA, int width, lineCap cap, std::uint32_t color, const canvas &target) {
+	if (width <= 1) {
+		drawLine(lineA, color, target);
+		return;
+	}
+	drawStats stats = {};
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		const bool clipped = fillShape<Format>(strokeShape(lineA, width, cap), Format::pack(color), target, stats);
+		countStroke(stats.pixelsDrawn, clipped, stats);
+	});
+	addDrawStats(stats);
+}
+
+
+// // POLYLINES // //
+
+enum class lineJoin { miter, round, bevel };
+
+// Miters longer than this many stroke widths are drawn as bevels.
+const double miterLimit = 4;
+
+inline bool samePoint(const coordinate &a, const coordinate &b) {
+	return a.x == b.x && a.y == b.y;
+}
+
+// Draws the connected segments points[0] to points[1] to ... points[count - 1]. Segments leave out
+// their end point, which is the next segment's start, so every vertex is written exactly once; the
+// last vertex is drawn on its own, unless the path closes on its first point. Repeated points are
+// skipped. Each vertex's outcode is computed once and shared by both of its segments, and the pixel
+// format is picked once for the whole path.
+void drawPolyline(const coordinate* points, std::size_t count, std::uint32_t color, const canvas &target) {
+	if (count == 0) return;
+	const bool runSlice = s_lineEngine == lineEngine::runSlice;
+	bool drewSegment = false;
+	if (s_lineEngine == lineEngine::reference) {
+		for (std::size_t i = 0; i + 1 < count; ++i) {
+			if (samePoint(points[i], points[i + 1])) continue;
+			line segment = { points[i], points[i + 1] };
+			drawLineReference(segment, color, target);
+			drewSegment = true;
+		}
+		if (!drewSegment || !samePoint(points[count - 1], points[0])) drawPixel(points[count - 1], color, target);
+		return;
+	}
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		const typename Format::packed packed = Format::pack(color);
+		drawStats stats = {};
+		int codeStart = outCode(points[0], target.clip);
+		for (std::size_t i = 0; i + 1 < count; ++i) {
+			if (samePoint(points[i], points[i + 1])) continue;
+			const int codeEnd = outCode(points[i + 1], target.clip);
+			line segment = { points[i], points[i + 1] };
+			lineSetup setup;
+			const bool visible = setupLine(segment, target.clip, codeStart, codeEnd, setup);
+			if (visible) {
+				if (runSlice) rasterizeRunSlice<Format>(setup, packed, target);
+				else rasterizeBresenham<Format>(setup, packed, target);
+				damageLine(segment, 0, target);
+			}
+			countLine(visible, setup, stats);
+			codeStart = codeEnd;
+			drewSegment = true;
+		}
+		if (drewSegment && samePoint(points[count - 1], points[0])) {
+			// // CLOSED PATH. The first segment already wrote the last vertex.
+		}
+		else if (codeStart == 0) {
+			Format::store(pixelAddress<Format>(points[count - 1], target), packed);
+			++stats.pixelsDrawn;
+			damageRect({ points[count - 1].x, points[count - 1].y, 1, 1 }, target);
+		}
+		else ++stats.pixelsRejected;
+		addDrawStats(stats);
+	});
+}
+
+// Shape that fills the gap on the outside of the corner at vertex between a stroke arriving in
+// direction in and one leaving in direction out. Both directions are unit vectors. Returns false
+// when the segments continue straight on and there is no gap.
+bool joinShape(const vertex &at, const vertex &in, const vertex &out, double half, lineJoin join, convexShape &shape) {
+	const double cross = in.x * out.y - in.y * out.x;
+	const double dot = in.x * out.x + in.y * out.y;
+	if (std::abs(cross) < 1e-9 && dot > 0) return false;
+
+	// Stroke edges on the outside of the turn.
+	const double side = cross > 0 ? -half : half;
+	const vertex edgeIn = { at.x - in.y * side, at.y + in.x * side };
+	const vertex edgeOut = { at.x - out.y * side, at.y + out.x * side };
+
+	shape.numDiscs = 0;
+	shape.radius = half;
+	if (join == lineJoin::round) {
+		shape.numPoints = 0;
+		shape.centers[0] = at;
+		shape.numDiscs = 1;
+		return true;
+	}
+	shape.points[0] = at;
+	shape.points[1] = edgeIn;
+	shape.numPoints = 3;
+	// The miter tip lies on the bisector, half / cos(turn / 2) from the vertex, where cos(turn) is dot.
+	if (join == lineJoin::miter && 1 + dot >= 2 / (miterLimit * miterLimit)) {
+		const vertex tip = { at.x + (edgeIn.x + edgeOut.x - 2 * at.x) / (1 + dot), at.y + (edgeIn.y + edgeOut.y - 2 * at.y) / (1 + dot) };
+		shape.points[2] = tip;
+		shape.points[3] = edgeOut;
+		shape.numPoints = 4;
+	}
+	else {
+		shape.points[2] = edgeOut;
+	}
+	return true;
+}
+
+// Draws a polyline width pixels wide: a butt stroke per segment, a join at every inner vertex and
+// a cap at each end, all filled with spans. Repeated points are skipped. Widths of one pixel or less
+// draw the one pixel polyline.
+void drawPolyline(const coordinate* points, std::size_t count, int width, lineJoin join, lineCap cap, std::uint32_t color, const canvas &target) {
+	if (width <= 1) {
+		drawPolyline(points, count, color, target);
+		return;
+	}
+	std::vector<coordinate> path;
+	path.reserve(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		if (path.empty() || path.back().x != points[i].x || path.back().y != points[i].y) path.push_back(points[i]);
+	}
+	if (path.size() < 2) {
+		if (!path.empty() && cap != lineCap::butt) {
+			line dot = { path[0], path[0] };
+			fillShape(strokeShape(dot, width, cap), color, target);
+		}
+		return;
+	}
+
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		const typename Format::packed packed = Format::pack(color);
+		const double half = width / 2.0;
+		drawStats stats = {};
+		vertex previousDirection = { 0, 0 };
+		for (std::size_t i = 0; i + 1 < path.size(); ++i) {
+			const line segment = { path[i], path[i + 1] };
+			const bool first = i == 0, last = i + 2 == path.size();
+			// Square caps lengthen only the two ends of the path, round caps add a disc there.
+			convexShape stroke = strokeShape(segment, width, lineCap::butt);
+			const double length = std::hypot(double(segment.end.x - segment.start.x), double(segment.end.y - segment.start.y));
+			const vertex direction = { (segment.end.x - segment.start.x) / length, (segment.end.y - segment.start.y) / length };
+			if (cap == lineCap::square) {
+				const double before = first ? half : 0, after = last ? half : 0;
+				for (int corner = 0; corner < 4; ++corner) {
+					const double along = corner == 1 || corner == 2 ? after : -before;
+					stroke.points[corner].x += direction.x * along;
+					stroke.points[corner].y += direction.y * along;
+				}
+			}
+			const std::uint64_t before = stats.pixelsDrawn;
+			const bool clipped = fillShape<Format>(stroke, packed, target, stats);
+			countStroke(stats.pixelsDrawn - before, clipped, stats);
+			if (cap == lineCap::round && (first || last)) {
+				convexShape end;
+				end.numPoints = 0;
+				end.numDiscs = 1;
+				end.radius = half;
+				end.centers[0] = first ? stroke.centers[0] : stroke.centers[1];
+				fillShape<Format>(end, packed, target, stats);
+				if (first && last) {
+					end.centers[0] = stroke.centers[1];
+					fillShape<Format>(end, packed, target, stats);
+				}
+			}
+			if (!first) {
+				convexShape corner;
+				if (joinShape(stroke.centers[0], previousDirection, direction, half, join, corner)) {
+					fillShape<Format>(corner, packed, target, stats);
+				}
+			}
+			previousDirection = direction;
+		}
+		addDrawStats(stats);
+	});
+}
+
+
+// // BATCHED LINES // //
+
+// Bucket of a line in a batch: the octants 0-7 of lineSetup, then axis-aligned and rejected lines.
+enum lineBucket { bucketHorizontal = 8, bucketVertical = 9, bucketRejected = 10, numBuckets = 11 };
+
+// Set on a classified line when both end points are inside the clip rect, so it needs no clipping.
+const std::uint8_t lineAccepted = 0x80;
+
+template <int Octant>
+struct octantSteps {
+	static const bool xMajor = (Octant & 4) != 0;
+	static const int driveStep = (Octant & (xMajor ? 2 : 1)) ? -1 : 1;
+	static const int passStep = (Octant & (xMajor ? 1 : 2)) ? -1 : 1;
+};
+
+inline line lineAt(const line* lines, std::size_t i) { return lines[i]; }
+inline line lineAt(const lineBuffer &lines, std::size_t i) { return lines.get(i); }
+
+int bucketOf(const line &lineA) {
+	const int deltaX = lineA.end.x - lineA.start.x;
+	const int deltaY = lineA.end.y - lineA.start.y;
+	if (deltaY == 0) return bucketHorizontal;
+	if (deltaX == 0) return bucketVertical;
+	return (std::abs(deltaX) >= std::abs(deltaY) ? 4 : 0) | (deltaX < 0 ? 2 : 0) | (deltaY < 0 ? 1 : 0);
+}
+
+// Sorts every line of a batch into a bucket. The outcode tests for trivial accept and reject run on
+// one line per SSE2 register: x0, y0, x1, y1 are compared against the clip rect all at once.
+void classifyLines(const line* lines, std::size_t count, const SDL_Rect &clip, std::uint8_t* classes) {
+	static_assert(sizeof(line) == 4 * sizeof(int), "line must be four packed ints");
+#if DRAW_SSE2
+	const __m128i low = _mm_setr_epi32(clip.x, clip.y, clip.x, clip.y);
+	const __m128i high = _mm_setr_epi32(clip.x + clip.w - 1, clip.y + clip.h - 1, clip.x + clip.w - 1, clip.y + clip.h - 1);
+	for (std::size_t i = 0; i < count; ++i) {
+		const __m128i ends = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lines + i));
+		const int below = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(ends, low)));
+		const int above = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(ends, high)));
+		if (((below & (below >> 2)) | (above & (above >> 2))) & 3) {
+			classes[i] = bucketRejected;
+			continue;
+		}
+		classes[i] = static_cast<std::uint8_t>(bucketOf(lines[i]) | ((below | above) == 0 ? lineAccepted : 0));
+	}
+#else
+	for (std::size_t i = 0; i < count; ++i) {
+		const int codeStart = outCode(lines[i].start, clip);
+		const int codeEnd = outCode(lines[i].end, clip);
+		if (codeStart & codeEnd) {
+			classes[i] = bucketRejected;
+			continue;
+		}
+		classes[i] = static_cast<std::uint8_t>(bucketOf(lines[i]) | ((codeStart | codeEnd) == 0 ? lineAccepted : 0));
+	}
+#endif
+}
+
+// The same classification for a lineBuffer, testing four lines per SSE2 register.
+void classifyLines(const lineBuffer &lines, std::size_t count, const SDL_Rect &clip, std::uint8_t* classes) {
+	std::size_t i = 0;
+#if DRAW_SSE2
+	const __m128i left = _mm_set1_epi32(clip.x), right = _mm_set1_epi32(clip.x + clip.w - 1);
+	const __m128i top = _mm_set1_epi32(clip.y), bottom = _mm_set1_epi32(clip.y + clip.h - 1);
+	for (; i + 4 <= count; i += 4) {
+		const __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lines.x0.data() + i));
+		const __m128i y0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lines.y0.data() + i));
+		const __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lines.x1.data() + i));
+		const __m128i y1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lines.y1.data() + i));
+		const __m128i outStart = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi32(x0, left), _mm_cmpgt_epi32(x0, right)),
+			_mm_or_si128(_mm_cmplt_epi32(y0, top), _mm_cmpgt_epi32(y0, bottom)));
+		const __m128i outEnd = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi32(x1, left), _mm_cmpgt_epi32(x1, right)),
+			_mm_or_si128(_mm_cmplt_epi32(y1, top), _mm_cmpgt_epi32(y1, bottom)));
+		const __m128i rejected = _mm_or_si128(
+			_mm_or_si128(_mm_and_si128(_mm_cmplt_epi32(x0, left), _mm_cmplt_epi32(x1, left)), _mm_and_si128(_mm_cmpgt_epi32(x0, right), _mm_cmpgt_epi32(x1, right))),
+			_mm_or_si128(_mm_and_si128(_mm_cmplt_epi32(y0, top), _mm_cmplt_epi32(y1, top)), _mm_and_si128(_mm_cmpgt_epi32(y0, bottom), _mm_cmpgt_epi32(y1, bottom))));
+		const int rejectMask = _mm_movemask_ps(_mm_castsi128_ps(rejected));
+		const int outsideMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(outStart, outEnd)));
+		for (int lane = 0; lane < 4; ++lane) {
+			if (rejectMask & (1 << lane)) {
+				classes[i + lane] = bucketRejected;
+				continue;
+			}
+			classes[i + lane] = static_cast<std::uint8_t>(bucketOf(lines.get(i + lane)) | (outsideMask & (1 << lane) ? 0 : lineAccepted));
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		const line lineA = lines.get(i);
+		const int codeStart = outCode(lineA.start, clip);
+		const int codeEnd = outCode(lineA.end, clip);
+		if (codeStart & codeEnd) {
+			classes[i] = bucketRejected;
+			continue;
+		}
+		classes[i] = static_cast<std::uint8_t>(bucketOf(lineA) | ((codeStart | codeEnd) == 0 ? lineAccepted : 0));
+	}
+}
+
+// Draws a line that lies inside the clip rect with the kernel for Octant, skipping setupLine.
+template <typename Format, int Octant>
+int drawAcceptedLine(const line &lineA, typename Format::packed color, const canvas &target) {
+	typedef octantSteps<Octant> steps;
+	const int absX = std::abs(lineA.end.x - lineA.start.x);
+	const int absY = std::abs(lineA.end.y - lineA.start.y);
+	const int driving = steps::xMajor ? absX : absY;
+	const int passive = steps::xMajor ? absY : absX;
+	std::uint8_t* pixel = pixelAddress<Format>(lineA.start, target);
+	if (s_lineEngine == lineEngine::runSlice && driving >= runSliceMinRatio * passive) {
+		runSliceOctant<Format, steps::xMajor, steps::driveStep, steps::passStep>(pixel, target.pitch, driving, 2 * passive - driving, 2 * passive, 2 * driving, color);
+	}
+	else {
+		bresenhamOctant<Format, steps::xMajor, steps::driveStep, steps::passStep>(pixel, target.pitch, driving, 2 * passive - driving, 2 * passive, 2 * driving, color);
+	}
+	return driving;
+}
+
+// Axis-aligned lines are filled left to right or top to bottom. A point is a horizontal line of one pixel.
+template <typename Format>
+int drawAcceptedAxisLine(const line &lineA, bool horizontal, typename Format::packed color, const canvas &target) {
+	const int delta = horizontal ? lineA.end.x - lineA.start.x : lineA.end.y - lineA.start.y;
+	const int length = std::max(std::abs(delta), 1);
+	coordinate first = lineA.start;
+	if (delta < 0) (horizontal ? first.x : first.y) -= length - 1;
+	if (horizontal) fillSpan<Format>(pixelAddress<Format>(first, target), length, color);
+	else fillColumn<Format>(pixelAddress<Format>(first, target), length, target.pitch, color);
+	return length;
+}
+
+// Draws the lines of one bucket back to back. Lines that cross the clip rect go through setupLine and
+// the selected engine, as in drawLine.
+template <typename Format, int Bucket, typename Lines, typename ColorAt>
+void drawBucket(const Lines &lines, const std::uint32_t* indices, std::size_t count, const std::uint8_t* classes, ColorAt colorAt, drawStats &stats, const canvas &target) {
+	for (std::size_t n = 0; n < count; ++n) {
+		const std::uint32_t i = indices[n];
+		const line lineA = lineAt(lines, i);
+		const typename Format::packed color = colorAt(i);
+		if (!(classes[i] & lineAccepted)) {
+			lineSetup setup;
+			const bool visible = setupLine(lineA, target.clip, setup);
+			if (visible) {
+				if (s_lineEngine == lineEngine::runSlice) rasterizeRunSlice<Format>(setup, color, target);
+				else rasterizeBresenham<Format>(setup, color, target);
+			}
+			countLine(visible, setup, stats);
+			continue;
+		}
+		++stats.linesDrawn;
+		if (Bucket == bucketHorizontal || Bucket == bucketVertical) {
+			stats.pixelsDrawn += drawAcceptedAxisLine<Format>(lineA, Bucket == bucketHorizontal, color, target);
+		}
+		else {
+			stats.pixelsDrawn += drawAcceptedLine<Format, Bucket & 7>(lineA, color, target);
+		}
+	}
+}
+
+// Records one rectangle around every line of a batch, rather than a rectangle per line.
+template <typename Lines>
+void damageLines(const Lines &lines, std::size_t count, const canvas &target) {
+	if (target.damage == nullptr || count == 0) return;
+	int left = std::numeric_limits<int>::max(), top = std::numeric_limits<int>::max();
+	int right = std::numeric_limits<int>::min(), bottom = std::numeric_limits<int>::min();
+	for (std::size_t i = 0; i < count; ++i) {
+		const line lineA = lineAt(lines, i);
+		left = std::min(left, std::min(lineA.start.x, lineA.end.x));
+		right = std::max(right, std::max(lineA.start.x, lineA.end.x));
+		top = std::min(top, std::min(lineA.start.y, lineA.end.y));
+		bottom = std::max(bottom, std::max(lineA.start.y, lineA.end.y));
+	}
+	damageLine({ { left, top }, { right, bottom } }, 0, target);
+}
+
+// Classifies the batch, sorts it into buckets and runs each bucket's kernel. Only consecutive lines of
+// the same color are sorted together; a change of color starts a new run, so overlapping lines end up
+// the same color as with drawLine calls in submission order.
+template <typename Lines, typename ColorOf>
+void drawLineBatch(const Lines &lines, std::size_t count, ColorOf colorOf, const canvas &target) {
+	if (s_lineEngine == lineEngine::reference) {
+		for (std::size_t i = 0; i < count; ++i) drawLineReference(lineAt(lines, i), colorOf(i), target);
+		return;
+	}
+
+	std::vector<std::uint8_t> classes(count);
+	classifyLines(lines, count, target.clip, classes.data());
+	std::vector<std::uint32_t> indices(count);
+
+	withPixelFormat(target.format, [&](auto format) {
+		typedef decltype(format) Format;
+		auto colorAt = [&](std::size_t i) { return Format::pack(colorOf(i)); };
+		const std::uint8_t* lineClasses = classes.data();
+		drawStats stats = {};
+		for (std::size_t runStart = 0, runEnd; runStart < count; runStart = runEnd) {
+			const std::uint32_t runColor = colorOf(runStart);
+			for (runEnd = runStart + 1; runEnd < count && colorOf(runEnd) == runColor; ++runEnd) {}
+
+			// // COUNTING SORT OF THE RUN BY BUCKET
+			std::size_t offsets[numBuckets + 1] = {};
+			for (std::size_t i = runStart; i < runEnd; ++i) ++offsets[(classes[i] & ~lineAccepted) + 1];
+			offsets[0] = runStart;
+			for (int bucket = 0; bucket < numBuckets; ++bucket) offsets[bucket + 1] += offsets[bucket];
+			std::size_t next[numBuckets];
+			std::copy(offsets, offsets + numBuckets, next);
+			for (std::size_t i = runStart; i < runEnd; ++i) indices[next[classes[i] & ~lineAccepted]++] = static_cast<std::uint32_t>(i);
+
+			const std::uint32_t* order = indices.data();
+			stats.linesRejected += offsets[bucketRejected + 1] - offsets[bucketRejected];
+			drawBucket<Format, 0>(lines, order + offsets[0], offsets[1] - offsets[0], lineClasses, colorAt, stats, target);
+			drawBucket<Format, 1>(lines, order + offsets[1], offsets[2] - offsets[1], lineClasses, colorAt, stats, target);
+			drawBucket<Format, 2>(lines, order + offsets[2], offsets[3] - offsets[2], lineClasses, colorAt, stats, target);
+			drawBucket<Format, 3>(lines, order + offsets[3], offsets[4] - offsets[3], lineClasses, colorAt, stats, target);
+			drawBucket<Format, 4>(lines, order + offsets[4], offsets[5] - offsets[4], lineClasses, colorAt, stats, target);
+			drawBucket<Format, 5>(lines, order + offsets[5], offsets[6] - offsets[5], lineClasses, colorAt, stats, target);
+			drawBucket<Format, 6>(lines, order + offsets[6], offsets[7] - offsets[6], lineClasses, colorAt, stats, target);
+			drawBucket<Format, 7>(lines, order + offsets[7], offsets[8] - offsets[7], lineClasses, colorAt, stats, target);
+			drawBucket<Format, bucketHorizontal>(lines, order + offsets[8], offsets[9] - offsets[8], lineClasses, colorAt, stats, target);
+			drawBucket<Format, bucketVertical>(lines, order + offsets[9], offsets[10] - offsets[9], lineClasses, colorAt, stats, target);
+		}
+		addDrawStats(stats);
+	});
+	damageLines(lines, count, target);
+}
+
+void drawLines(const line* lines, std::size_t count, std::uint32_t color, const canvas &target) {
+	drawLineBatch(lines, count, [color](std::size_t) { return color; }, target);
+}
+
+void drawLines(const line* lines, std::size_t count, const std::uint32_t* colors, const canvas &target) {
+	drawLineBatch(lines, count, [colors](std::size_t i) { return colors[i]; }, target);
+}
+
+void drawLines(const lineBuffer &lines, std::uint32_t color, const canvas &target) {
+	drawLineBatch(lines, lines.size(), [color](std::size_t) { return color; }, target);
+}
+
+// Draws every line in its own color from lines.color. Returns false, with the SDL error set, when the
+// buffer doesn't hold a color for every line.
+bool drawLines(const lineBuffer &lines, const canvas &target) {
+	if (lines.color.size() != lines.size()) {
+		SDL_SetError("Line buffer has %u colors for %u lines", static_cast<unsigned>(lines.color.size()), static_cast<unsigned>(lines.size()));
+		return false;
+	}
+	const std::uint32_t* colors = lines.color.data();
+	drawLineBatch(lines, lines.size(), [colors](std::size_t i) { return colors[i]; }, target);
+	return true;
+}
+
+
+// // PARALLEL TILED LINES // //
+
+// Side of the square tiles that worker threads own, in pixels.
+const int tileSize = 64;
+
+// Calls addToTile with the index of every tile the visible part of lineA crosses. The line is walked
+// one tile column (or row) at a time along its driving axis, using the closed form of the passive offset.
+template <typename AddToTile>
+void binLine(const line &lineA, const SDL_Rect &clip, int tilesAcross, AddToTile addToTile) {
+	lineSetup setup;
+	if (!setupLine(lineA, clip, setup)) return;
+	if (setup.twoDriving == 0) {
+		addToTile(setup.start.y / tileSize * tilesAcross + setup.start.x / tileSize);
+		return;
+	}
+
+	const bool xMajor = (setup.octant & 4) != 0;
+	const int driveStep = (setup.octant & (xMajor ? 2 : 1)) ? -1 : 1;
+	const int passStep = (setup.octant & (xMajor ? 1 : 2)) ? -1 : 1;
+	const int driving0 = xMajor ? setup.start.x : setup.start.y;
+	const int passive0 = xMajor ? setup.start.y : setup.start.x;
+	// Passive offset after step steps is floor((bias + twoPassive * step) / twoDriving).
+	const long long bias = static_cast<long long>(setup.error) + setup.twoDriving - setup.twoPassive;
+
+	for (int step = 0; step < setup.length; ) {
+		const int driving = driving0 + driveStep * step;
+		const int driveTile = driving / tileSize;
+		const int toEdge = driveStep > 0 ? (driveTile + 1) * tileSize - driving : driving - driveTile * tileSize + 1;
+		const int chunk = std::min(setup.length - step, toEdge);
+		const int passiveFirst = passive0 + passStep * static_cast<int>((bias + static_cast<long long>(setup.twoPassive) * step) / setup.twoDriving);
+		const int passiveLast = passive0 + passStep * static_cast<int>((bias + static_cast<long long>(setup.twoPassive) * (step + chunk - 1)) / setup.twoDriving);
+		const int passTileFirst = std::min(passiveFirst, passiveLast) / tileSize;
+		const int passTileLast = std::max(passiveFirst, passiveLast) / tileSize;
+		for (int passTile = passTileFirst; passTile <= passTileLast; ++passTile) {
+			addToTile(xMajor ? passTile * tilesAcross + driveTile : driveTile * tilesAcross + passTile);
+		}
+		step += chunk;
+	}
+}
+
+// Draws lines on worker threads. Each worker bins a contiguous share of the lines into the tiles they
+// cross; then workers take whole tiles and draw every line binned there, clipped to the tile. A tile
+// belongs to one worker, so the framebuffer needs no locks, and lines reach each tile in submission
+// order, so the result is pixel for pixel what drawLine gives.
+template <typename ColorOf>
+void drawLinesTiled(const lineBuffer &lines, ColorOf colorOf, const canvas &target, int numThreads) {
+	const std::size_t count = lines.size();
+	if (s_lineEngine == lineEngine::reference) {
+		for (std::size_t i = 0; i < count; ++i) drawLineReference(lines.get(i), colorOf(i), target);
+		return;
+	}
+	if (numThreads <= 0) numThreads = SDL_GetCPUCount();
+
+	// Tiles are laid over the clip rect, limited to the canvas.
+	SDL_Rect clip;
+	clip.x = std::max(target.clip.x, 0);
+	clip.y = std::max(target.clip.y, 0);
+	clip.w = std::min(target.clip.x + target.clip.w, target.width) - clip.x;
+	clip.h = std::min(target.clip.y + target.clip.h, target.height) - clip.y;
+	if (clip.w <= 0 || clip.h <= 0 || count == 0) return;
+	const int tilesAcross = (clip.x + clip.w + tileSize - 1) / tileSize;
+	const int tilesDown = (clip.y + clip.h + tileSize - 1) / tileSize;
+	const int numTiles = tilesAcross * tilesDown;
+
+	// // BIN LINES. bins[worker * numTiles + tile] holds line indices in submission order.
+	std::vector<std::vector<std::uint32_t>> bins(static_cast<std::size_t>(numThreads) * numTiles);
+	std::vector<std::thread> workers;
+	for (int worker = 0; worker < numThreads; ++worker) {
+		workers.emplace_back([&, worker]() {
+			const std::size_t first = count * worker / numThreads;
+			const std::size_t last = count * (worker + 1) / numThreads;
+			std::vector<std::uint32_t>* workerBins = bins.data() + static_cast<std::size_t>(worker) * numTiles;
+			drawStats stats = {};
+			for (std::size_t i = first; i < last; ++i) {
+				const line lineA = lines.get(i);
+				bool visible = false;
+				binLine(lineA, clip, tilesAcross, [&](int tile) {
+					workerBins[tile].push_back(static_cast<std::uint32_t>(i));
+					visible = true;
+				});
+				if (!visible) ++stats.linesRejected;
+				else {
+					++stats.linesDrawn;
+					stats.linesClipped += (outCode(lineA.start, clip) | outCode(lineA.end, clip)) != 0;
+				}
+			}
+			addDrawStats(stats);
+		});
+	}
+	for (auto &thread : workers) thread.join();
+	workers.clear();
+
+	// // DRAW TILES
+	std::atomic<int> nextTile(0);
+	for (int worker = 0; worker < numThreads; ++worker) {
+		workers.emplace_back([&]() {
+			withPixelFormat(target.format, [&](auto format) {
+				typedef decltype(format) Format;
+				drawStats stats = {};
+				for (int tile = nextTile++; tile < numTiles; tile = nextTile++) {
+					SDL_Rect tileClip;
+					tileClip.x = std::max(tile % tilesAcross * tileSize, clip.x);
+					tileClip.y = std::max(tile / tilesAcross * tileSize, clip.y);
+					tileClip.w = std::min((tile % tilesAcross + 1) * tileSize, clip.x + clip.w) - tileClip.x;
+					tileClip.h = std::min((tile / tilesAcross + 1) * tileSize, clip.y + clip.h) - tileClip.y;
+					if (tileClip.w <= 0 || tileClip.h <= 0) continue;
+					for (int binner = 0; binner < numThreads; ++binner) {
+						for (std::uint32_t i : bins[static_cast<std::size_t>(binner) * numTiles + tile]) {
+							lineSetup setup;
+							if (!setupLine(lines.get(i), tileClip, setup)) continue;
+							if (s_lineEngine == lineEngine::runSlice) rasterizeRunSlice<Format>(setup, Format::pack(colorOf(i)), target);
+							else rasterizeBresenham<Format>(setup, Format::pack(colorOf(i)), target);
+							stats.pixelsDrawn += setup.length;
+						}
+					}
+				}
+				addDrawStats(stats);
+			});
+		});
+	}
+	for (auto &thread : workers) thread.join();
+	damageLines(lines, count, target);
+}
+
+// numThreads of 0 uses one worker per CPU.
+void drawLinesParallel(const lineBuffer &lines, std::uint32_t color, const canvas &target, int numThreads = 0) {
+	drawLinesTiled(lines, [color](std::size_t) { return color; }, target, numThreads);
+}
+
+// Draws every line in its own color from lines.color. Returns false, with the SDL error set, when the
+// buffer doesn't hold a color for every line.
+bool drawLinesParallel(const lineBuffer &lines, const canvas &target, int numThreads = 0) {
+	if (lines.color.size() != lines.size()) {
+		SDL_SetError("Line buffer has %u colors for %u lines", static_cast<unsigned>(lines.color.size()), static_cast<unsigned>(lines.size()));
+		return false;
+	}
+	const std::uint32_t* colors = lines.color.data();
+	drawLinesTiled(lines, [colors](std::size_t i) { return colors[i]; }, target, numThreads);
+	return true;
+}
+
+
+// // IMAGE WRITERS // //
+
+// Output file for the image writers. Pieces of the file are queued by reference and written together,
+// with writev where the platform has it, so rows that need no conversion go from canvas memory to the
+// file without a copy. Headers and converted rows are built in a staging buffer that is only reused
+// after the pieces pointing into it have been written.
+struct imageStream {
+	static const int maxPieces = 64;
+	static const std::size_t stagingSize = 1 << 20;
+	int file;
+	bool failed;
+	std::vector<std::uint8_t> staging;
+	std::size_t staged;
+	const std::uint8_t* pieces[maxPieces];
+	std::size_t sizes[maxPieces];
+	int numPieces;
+};
+
+// Opens path for writing, or standard output when path is "-".
+bool openImageStream(imageStream &stream, const std::string &path) {
+#if defined(_WIN32)
+	if (path == "-") {
+		_setmode(_fileno(stdout), _O_BINARY);
+		stream.file = _dup(_fileno(stdout));
+	}
+	else stream.file = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	if (path == "-") stream.file = dup(STDOUT_FILENO);
+	else stream.file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (stream.file < 0) {
+		SDL_SetError("Can't create %s", path.c_str());
+		return false;
+	}
+	stream.failed = false;
+	stream.staging.resize(imageStream::stagingSize);
+	stream.staged = 0;
+	stream.numPieces = 0;
+	return true;
+}
+
+void flushImageStream(imageStream &stream) {
+#if defined(_WIN32)
+	for (int i = 0; i < stream.numPieces && !stream.failed; ++i) {
+		const std::uint8_t* data = stream.pieces[i];
+		std::size_t size = stream.sizes[i];
+		while (size > 0) {
+			const int written = _write(stream.file, data, static_cast<unsigned>(std::min<std::size_t>(size, 1 << 30)));
+			if (written <= 0) {
+				stream.failed = true;
+				break;
+			}
+			data += written;
+			size -= written;
+		}
+	}
+#else
+	iovec vectors[imageStream::maxPieces];
+	for (int i = 0; i < stream.numPieces; ++i) {
+		vectors[i].iov_base = const_cast<std::uint8_t*>(stream.pieces[i]);
+		vectors[i].iov_len = stream.sizes[i];
+	}
+	int first = 0;
+	while (first < stream.numPieces && !stream.failed) {
+		ssize_t written = writev(stream.file, vectors + first, stream.numPieces - first);
+		if (written < 0) {
+			if (errno != EINTR) stream.failed = true;
+			continue;
+		}
+		// // PARTIAL WRITE. Skip the pieces that went out and trim the one cut short.
+		while (first < stream.numPieces && static_cast<std::size_t>(written) >= vectors[first].iov_len) {
+			written -= vectors[first].iov_len;
+			++first;
+		}
+		if (first < stream.numPieces) {
+			vectors[first].iov_base = static_cast<std::uint8_t*>(vectors[first].iov_base) + written;
+			vectors[first].iov_len -= written;
+		}
+	}
+#endif
+	stream.numPieces = 0;
+	stream.staged = 0;
+}
+
+// Queues size bytes at data, which must stay valid until the stream is flushed or closed. A piece that
+// continues the previous one, like the next row of a canvas without row padding, extends it.
+void streamBytes(imageStream &stream, const void* data, std::size_t size) {
+	const std::uint8_t* bytes = static_cast<const std::uint8_t*>(data);
+	if (stream.numPieces > 0 && stream.pieces[stream.numPieces - 1] + stream.sizes[stream.numPieces - 1] == bytes) {
+		stream.sizes[stream.numPieces - 1] += size;
+		return;
+	}
+	if (stream.numPieces == imageStream::maxPieces) flushImageStream(stream);
+	stream.pieces[stream.numPieces] = bytes;
+	stream.sizes[stream.numPieces] = size;
+	++stream.numPieces;
+}
+
+// Returns size bytes of staging to fill, already queued for writing.
+std::uint8_t* stageBytes(imageStream &stream, std::size_t size) {
+	if (stream.numPieces == imageStream::maxPieces || stream.staged + size > stream.staging.size()) {
+		flushImageStream(stream);
+		if (size > stream.staging.size()) stream.staging.resize(size);
+	}
+	std::uint8_t* bytes = stream.staging.data() + stream.staged;
+	stream.staged += size;
+	streamBytes(stream, bytes, size);
+	return bytes;
+}
+
+// Writes whatever is queued and closes the file. Returns false, with the SDL error set, if any write failed.
+bool closeImageStream(imageStream &stream, const std::string &path) {
+	flushImageStream(stream);
+#if defined(_WIN32)
+	const bool closed = _close(stream.file) == 0;
+#else
+	const bool closed = close(stream.file) == 0;
+#endif
+	if (stream.failed || !closed) {
+		SDL_SetError("Can't write %s", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+#if DRAW_SSE2
+// Swaps the first and third byte of each 32-bit pixel.
+inline __m128i swapRedBlue(__m128i pixels) {
+	const __m128i keep = _mm_set1_epi32(static_cast<int>(0xFF00FF00u));
+	const __m128i low = _mm_set1_epi32(0xFF);
+	return _mm_or_si128(_mm_and_si128(pixels, keep),
+		_mm_or_si128(_mm_and_si128(_mm_srli_epi32(pixels, 16), low), _mm_slli_epi32(_mm_and_si128(pixels, low), 16)));
+}
+
+// Packs the first three bytes of four 32-bit pixels into the low 12 bytes. Without a byte shuffle each
+// 64-bit half is closed up with a shift first, then the upper half is moved down against the lower.
+inline __m128i packRGB24(__m128i pixels) {
+	const __m128i firstPixel = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+	const __m128i secondPixel = _mm_set_epi32(0x0000FFFF, static_cast<int>(0xFF000000u), 0x0000FFFF, static_cast<int>(0xFF000000u));
+	const __m128i halves = _mm_or_si128(_mm_and_si128(pixels, firstPixel), _mm_and_si128(_mm_srli_epi64(pixels, 8), secondPixel));
+	const __m128i lowerHalf = _mm_set_epi32(0, 0, 0x0000FFFF, -1);
+	return _mm_or_si128(_mm_and_si128(halves, lowerHalf), _mm_andnot_si128(lowerHalf, _mm_srli_si128(halves, 2)));
+}
+#endif
+
+// Reorders ARGB8888 pixels, stored B, G, R, A in memory, to R, G, B, A bytes.
+void swizzleToRGBA(const std::uint8_t* source, std::uint8_t* destination, int count) {
+	int i = 0;
+#if DRAW_SSE2
+	for (; i + 4 <= count; i += 4) {
+		const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 4), swapRedBlue(pixels));
+	}
+#endif
+	for (; i < count; ++i) {
+		destination[i * 4 + 0] = source[i * 4 + 2];
+		destination[i * 4 + 1] = source[i * 4 + 1];
+		destination[i * 4 + 2] = source[i * 4 + 0];
+		destination[i * 4 + 3] = source[i * 4 + 3];
+	}
+}
+
+// Reorders ARGB8888 pixels to R, G, B bytes, dropping alpha. Four pixels are packed per step, by one
+// shuffle with SSSE3 or by shifts and masks with SSE2; each 16-byte store runs 4 bytes ahead, which the
+// next store overwrites, so the vector loop stops while 16 bytes of destination are still left.
+void swizzleToRGB(const std::uint8_t* source, std::uint8_t* destination, int count) {
+	int i = 0;
+#if DRAW_SSSE3
+	const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	for (; i + 6 <= count; i += 4) {
+		const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 3), _mm_shuffle_epi8(pixels, order));
+	}
+#elif DRAW_SSE2
+	for (; i + 6 <= count; i += 4) {
+		const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 3), packRGB24(swapRedBlue(pixels)));
+	}
+#endif
+	for (; i < count; ++i) {
+		destination[i * 3 + 0] = source[i * 4 + 2];
+		destination[i * 3 + 1] = source[i * 4 + 1];
+		destination[i * 3 + 2] = source[i * 4 + 0];
+	}
+}
+
+// Swaps R and B of RGB24 pixels, giving the B, G, R order of BMP. Five pixels are swapped per step,
+// reading and writing 16 bytes at a time while that stays inside both rows. SSSE3 does it with one
+// shuffle; with SSE2 the first and third byte of each pixel are taken from the vector shifted by two.
+void swapRGB24(const std::uint8_t* source, std::uint8_t* destination, int count) {
+	int i = 0;
+#if DRAW_SSSE3
+	const __m128i order = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+	for (; i + 6 <= count; i += 5) {
+		const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 3), _mm_shuffle_epi8(pixels, order));
+	}
+#elif DRAW_SSE2
+	const __m128i first = _mm_setr_epi8(-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, 0);
+	const __m128i third = _mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0);
+	const __m128i moved = _mm_or_si128(first, third);
+	for (; i + 6 <= count; i += 5) {
+		const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 3));
+		const __m128i swapped = _mm_or_si128(_mm_andnot_si128(moved, pixels),
+			_mm_or_si128(_mm_and_si128(_mm_srli_si128(pixels, 2), first), _mm_and_si128(_mm_slli_si128(pixels, 2), third)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 3), swapped);
+	}
+#endif
+	for (; i < count; ++i) {
+		destination[i * 3 + 0] = source[i * 3 + 2];
+		destination[i * 3 + 1] = source[i * 3 + 1];
+		destination[i * 3 + 2] = source[i * 3 + 0];
+	}
+}
+
+// Expands RGB565 pixels to R, G, B bytes, copying the top bits of each channel into its low bits. With
+// SSE2 eight pixels are widened per step, in 16-bit lanes, then unpacked to 32-bit pixels and packed to
+// 24 bytes by two stores; the second runs 4 bytes ahead, so the loop keeps two pixels in hand.
+void expandRGB565(const std::uint8_t* source, std::uint8_t* destination, int count) {
+	int i = 0;
+#if DRAW_SSE2
+	const __m128i fiveBits = _mm_set1_epi16(0x1F);
+	const __m128i sixBits = _mm_set1_epi16(0x3F);
+	for (; i + 10 <= count; i += 8) {
+		const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 2));
+		const __m128i red = _mm_srli_epi16(pixels, 11);
+		const __m128i green = _mm_and_si128(_mm_srli_epi16(pixels, 5), sixBits);
+		const __m128i blue = _mm_and_si128(pixels, fiveBits);
+		const __m128i redGreen = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(red, 3), _mm_srli_epi16(red, 2)),
+			_mm_slli_epi16(_mm_or_si128(_mm_slli_epi16(green, 2), _mm_srli_epi16(green, 4)), 8));
+		const __m128i blueZero = _mm_or_si128(_mm_slli_epi16(blue, 3), _mm_srli_epi16(blue, 2));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 3), packRGB24(_mm_unpacklo_epi16(redGreen, blueZero)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i * 3 + 12), packRGB24(_mm_unpackhi_epi16(redGreen, blueZero)));
+	}
+#endif
+	for (; i < count; ++i) {
+		const int pixel = source[i * 2] | (source[i * 2 + 1] << 8);
+		const int red = pixel >> 11, green = (pixel >> 5) & 0x3F, blue = pixel & 0x1F;
+		destination[i * 3 + 0] = static_cast<std::uint8_t>((red << 3) | (red >> 2));
+		destination[i * 3 + 1] = static_cast<std::uint8_t>((green << 2) | (green >> 4));
+		destination[i * 3 + 2] = static_cast<std::uint8_t>((blue << 3) | (blue >> 2));
+	}
+}
+
+typedef void (*rowConverter)(const std::uint8_t* source, std::uint8_t* destination, int count);
+
+// Queues every row of image top to bottom. Rows are converted into staging by convert, or written
+// from the canvas when convert is nullptr. Each row is followed by padding zero bytes.
+void streamRows(imageStream &stream, const canvas &image, int bytesOut, rowConverter convert, int padding = 0) {
+	static const std::uint8_t zeros[4] = {};
+	const std::size_t rowBytes = static_cast<std::size_t>(image.width) * bytesOut;
+	for (int row = 0; row < image.height; ++row) {
+		const std::uint8_t* source = image.pixels + static_cast<std::ptrdiff_t>(row) * image.pitch;
+		if (convert) convert(source, stageBytes(stream, rowBytes), image.width);
+		else streamBytes(stream, source, rowBytes);
+		if (padding) streamBytes(stream, zeros, padding);
+	}
+}
+
+void stageText(imageStream &stream, const char* text) {
+	const std::size_t length = std::strlen(text);
+	std::memcpy(stageBytes(stream, length), text, length);
+}
+
+// Writes a binary PPM: P6 with R, G, B samples, or P5 gray for index8 canvases.
+bool writePPM(const canvas &image, const std::string &path) {
+	imageStream stream;
+	if (!openImageStream(stream, path)) return false;
+	char header[64];
+	std::snprintf(header, sizeof(header), "%s\n%d %d\n255\n", image.format == pixelFormat::index8 ? "P5" : "P6", image.width, image.height);
+	stageText(stream, header);
+	switch (image.format) {
+	case pixelFormat::argb8888: streamRows(stream, image, 3, swizzleToRGB); break;
+	case pixelFormat::rgb565: streamRows(stream, image, 3, expandRGB565); break;
+	case pixelFormat::rgb24: streamRows(stream, image, 3, nullptr); break;
+	case pixelFormat::index8: streamRows(stream, image, 1, nullptr); break;
+	}
+	return closeImageStream(stream, path);
+}
+
+// Formats the PAM header for a width by height image of format. ARGB8888 keeps its alpha as RGB_ALPHA,
+// index8 is GRAYSCALE and the rest RGB. Returns the length of the header.
+int formatPAMHeader(char* header, std::size_t size, int width, int height, pixelFormat format) {
+	const int depth = format == pixelFormat::argb8888 ? 4 : format == pixelFormat::index8 ? 1 : 3;
+	const char* tupleType = depth == 4 ? "RGB_ALPHA" : depth == 1 ? "GRAYSCALE" : "RGB";
+	return std::snprintf(header, size, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n", width, height, depth, tupleType);
+}
+
+// Writes a PAM.
+bool writePAM(const canvas &image, const std::string &path) {
+	imageStream stream;
+	if (!openImageStream(stream, path)) return false;
+	char header[128];
+	formatPAMHeader(header, sizeof(header), image.width, image.height, image.format);
+	stageText(stream, header);
+	switch (image.format) {
+	case pixelFormat::argb8888: streamRows(stream, image, 4, swizzleToRGBA); break;
+	case pixelFormat::rgb565: streamRows(stream, image, 3, expandRGB565); break;
+	case pixelFormat::rgb24: streamRows(stream, image, 3, nullptr); break;
+	case pixelFormat::index8: streamRows(stream, image, 1, nullptr); break;
+	}
+	return closeImageStream(stream, path);
+}
+
+// Stores value as bytes little-endian bytes and advances out.
+void putLittleEndian(std::uint8_t* &out, std::uint32_t value, int bytes) {
+	for (int i = 0; i < bytes; ++i) *out++ = static_cast<std::uint8_t>(value >> (8 * i));
+}
+
+// Bytes from the start of a BMP of format to the end of its headers, bitfields and palette.
+std::uint32_t bmpHeaderSize(pixelFormat format) {
+	return 14 + 40 + (format == pixelFormat::rgb565 ? 12 : 0) + (format == pixelFormat::index8 ? 1024 : 0);
+}
+
+// Bytes in a BMP row of width pixels of format, padded to 4 bytes.
+int bmpStride(int width, pixelFormat format) {
+	return (width * bytesPerPixel(format) + 3) & ~3;
+}
+
+// Fills the headers of a top-down BMP of format whose rows start dataOffset bytes into the file. Files
+// of 4 GiB or more don't fit the size fields, which are then left 0.
+void putBMPHeader(std::uint8_t* out, int width, int height, pixelFormat format, std::uint32_t dataOffset) {
+	const int bits = bytesPerPixel(format) * 8;
+	const bool bitfields = format == pixelFormat::rgb565;
+	const bool palette = format == pixelFormat::index8;
+	const std::uint64_t imageSize = static_cast<std::uint64_t>(bmpStride(width, format)) * height;
+	const std::uint64_t fileSize = dataOffset + imageSize;
+	// // BITMAPFILEHEADER
+	*out++ = 'B';
+	*out++ = 'M';
+	putLittleEndian(out, fileSize <= 0xFFFFFFFFu ? static_cast<std::uint32_t>(fileSize) : 0, 4);
+	putLittleEndian(out, 0, 4);
+	putLittleEndian(out, dataOffset, 4);
+	// // BITMAPINFOHEADER. A negative height stores rows top-down, in canvas order.
+	putLittleEndian(out, 40, 4);
+	putLittleEndian(out, static_cast<std::uint32_t>(width), 4);
+	putLittleEndian(out, static_cast<std::uint32_t>(-height), 4);
+	putLittleEndian(out, 1, 2);
+	putLittleEndian(out, bits, 2);
+	putLittleEndian(out, bitfields ? 3 : 0, 4);
+	putLittleEndian(out, fileSize <= 0xFFFFFFFFu ? static_cast<std::uint32_t>(imageSize) : 0, 4);
+	putLittleEndian(out, 2835, 4);
+	putLittleEndian(out, 2835, 4);
+	putLittleEndian(out, palette ? 256 : 0, 4);
+	putLittleEndian(out, 0, 4);
+	if (bitfields) {
+		putLittleEndian(out, 0xF800, 4);
+		putLittleEndian(out, 0x07E0, 4);
+		putLittleEndian(out, 0x001F, 4);
+	}
+	if (palette) {
+		for (int i = 0; i < 256; ++i) putLittleEndian(out, i * 0x010101u, 4);
+	}
+}
+
+// Writes a top-down BMP in the canvas's own layout where BMP has one: ARGB8888 as 32-bit, RGB565 as
+// 16-bit bitfields and index8 as 8-bit with a gray palette all stream straight from the canvas. RGB24
+// rows have R and B swapped on the way out.
+bool writeBMP(const canvas &image, const std::string &path) {
+	const int rowBytes = image.width * bytesPerPixel(image.format);
+	const std::uint32_t headerSize = bmpHeaderSize(image.format);
+
+	imageStream stream;
+	if (!openImageStream(stream, path)) return false;
+	putBMPHeader(stageBytes(stream, headerSize), image.width, image.height, image.format, headerSize);
+	streamRows(stream, image, bytesPerPixel(image.format), image.format == pixelFormat::rgb24 ? swapRGB24 : nullptr, bmpStride(image.width, image.format) - rowBytes);
+	return closeImageStream(stream, path);
+}
+
+
+// // PNG WRITER // //
+
+// CRC-32 of PNG chunks, one table lookup per byte.
+struct crcTable {
+	std::uint32_t entries[256];
+	crcTable() {
+		for (std::uint32_t n = 0; n < 256; ++n) {
+			std::uint32_t c = n;
+			for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			entries[n] = c;
+		}
+	}
+};
+static const crcTable s_crcTable;
+
+// Continues crc over size more bytes. Start from 0.
+std::uint32_t crc32(std::uint32_t crc, const std::uint8_t* data, std::size_t size) {
+	crc = ~crc;
+	for (std::size_t i = 0; i < size; ++i) crc = s_crcTable.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+const std::uint32_t adlerModulus = 65521;
+
+// Continues an Adler-32 checksum over size more bytes. Start from 1. The sums are reduced once every
+// 5552 bytes, the most that can't overflow 32 bits.
+std::uint32_t adler32(std::uint32_t adler, const std::uint8_t* data, std::size_t size) {
+	std::uint32_t low = adler & 0xFFFF, high = adler >> 16;
+	while (size > 0) {
+		const std::size_t block = std::min<std::size_t>(size, 5552);
+		for (std::size_t i = 0; i < block; ++i) {
+			low += data[i];
+			high += low;
+		}
+		low %= adlerModulus;
+		high %= adlerModulus;
+		data += block;
+		size -= block;
+	}
+	return low | (high << 16);
+}
+
+// Adler-32 of two pieces joined, from the checksum of each and the length of the second.
+std::uint32_t adler32Combine(std::uint32_t first, std::uint32_t second, std::size_t secondLength) {
+	const std::uint32_t remainder = static_cast<std::uint32_t>(secondLength % adlerModulus);
+	std::uint32_t low = first & 0xFFFF;
+	std::uint32_t high = static_cast<std::uint32_t>((static_cast<std::uint64_t>(remainder) * low) % adlerModulus);
+	low += (second & 0xFFFF) + adlerModulus - 1;
+	high += (first >> 16) + (second >> 16) + adlerModulus - remainder;
+	if (low >= adlerModulus) low -= adlerModulus;
+	if (low >= adlerModulus) low -= adlerModulus;
+	if (high >= 2 * adlerModulus) high -= 2 * adlerModulus;
+	if (high >= adlerModulus) high -= adlerModulus;
+	return low | (high << 16);
+}
+
+// Codes of deflate's fixed Huffman block, bit-reversed so they can be written least significant bit
+// first, and the bases of the length and distance codes.
+struct deflateTables {
+	std::uint16_t literalCode[288];
+	std::uint8_t literalLength[288];
+	std::uint8_t distanceCode[30];
+	std::uint8_t lengthSymbol[259];   // match length to length code minus 257
+	static const std::uint16_t lengthBase[29];
+	static const std::uint8_t lengthExtra[29];
+	static const std::uint16_t distanceBase[30];
+	static const std::uint8_t distanceExtra[30];
+
+	static std::uint32_t reverse(std::uint32_t code, int length) {
+		std::uint32_t reversed = 0;
+		for (int i = 0; i < length; ++i) reversed |= ((code >> i) & 1) << (length - 1 - i);
+		return reversed;
+	}
+
+	deflateTables() {
+		for (int symbol = 0; symbol < 288; ++symbol) {
+			std::uint32_t code;
+			int length;
+			if (symbol < 144) { code = 0x30 + symbol; length = 8; }
+			else if (symbol < 256) { code = 0x190 + symbol - 144; length = 9; }
+			else if (symbol < 280) { code = symbol - 256; length = 7; }
+			else { code = 0xC0 + symbol - 280; length = 8; }
+			literalCode[symbol] = static_cast<std::uint16_t>(reverse(code, length));
+			literalLength[symbol] = static_cast<std::uint8_t>(length);
+		}
+		for (int symbol = 0; symbol < 30; ++symbol) distanceCode[symbol] = static_cast<std::uint8_t>(reverse(symbol, 5));
+		for (int length = 3, symbol = 0; length <= 258; ++length) {
+			while (symbol < 28 && length >= lengthBase[symbol + 1]) ++symbol;
+			lengthSymbol[length] = static_cast<std::uint8_t>(symbol);
+		}
+	}
+};
+const std::uint16_t deflateTables::lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const std::uint8_t deflateTables::lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const std::uint16_t deflateTables::distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const std::uint8_t deflateTables::distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const deflateTables s_deflateTables;
+
+// Deflate output, least significant bit first.
+struct bitWriter {
+	std::vector<std::uint8_t> &out;
+	std::uint64_t bits;
+	int count;
+
+	explicit bitWriter(std::vector<std::uint8_t> &bytes) : out(bytes), bits(0), count(0) {}
+
+	void put(std::uint32_t value, int length) {
+		bits |= static_cast<std::uint64_t>(value) << count;
+		count += length;
+		while (count >= 8) {
+			out.push_back(static_cast<std::uint8_t>(bits));
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	void align() {
+		if (count > 0) out.push_back(static_cast<std::uint8_t>(bits));
+		bits = 0;
+		count = 0;
+	}
+};
+
+const int deflateWindow = 1 << 15;
+const int deflateHashBits = 15;
+const int deflateMaxChain = 32;
+const int deflateMinMatch = 3, deflateMaxMatch = 258;
+
+// Per-thread state of the compressor, kept between strips so the tables are allocated once.
+struct deflateState {
+	std::vector<std::int32_t> head;   // latest position of each 3-byte hash
+	std::vector<std::int32_t> chain;  // previous position with the same hash, by position in the window
+};
+
+// Compresses data as one fixed-Huffman deflate block with greedy LZ77 matching over hash chains.
+// Matches stay inside data, so strips compressed on different threads can be concatenated: every
+// strip but the last is closed with an empty stored block, which ends it on a byte boundary.
+void deflateStrip(const std::uint8_t* data, std::size_t size, bool last, deflateState &state, std::vector<std::uint8_t> &out) {
+	const deflateTables &tables = s_deflateTables;
+	state.head.assign(std::size_t(1) << deflateHashBits, -1);
+	state.chain.resize(deflateWindow);
+	out.clear();
+	out.reserve(size / 4 + 64);
+	bitWriter writer(out);
+	writer.put(last ? 1 : 0, 1);
+	writer.put(1, 2); // fixed Huffman codes
+
+	auto hashAt = [&](std::size_t i) {
+		return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & ((1 << deflateHashBits) - 1);
+	};
+	auto insert = [&](std::size_t i) {
+		if (i + deflateMinMatch > size) return;
+		const int hash = hashAt(i);
+		state.chain[i & (deflateWindow - 1)] = state.head[hash];
+		state.head[hash] = static_cast<std::int32_t>(i);
+	};
+
+	std::size_t i = 0;
+	while (i < size) {
+		int bestLength = 0, bestDistance = 0;
+		if (i + deflateMinMatch <= size) {
+			const int maxLength = static_cast<int>(std::min<std::size_t>(deflateMaxMatch, size - i));
+			std::int32_t candidate = state.head[hashAt(i)];
+			for (int tries = 0; candidate >= 0 && tries < deflateMaxChain; ++tries) {
+				const std::size_t distance = i - candidate;
+				if (distance > static_cast<std::size_t>(deflateWindow)) break;
+				if (data[candidate + bestLength] == data[i + bestLength]) {
+					int length = 0;
+					while (length < maxLength && data[candidate + length] == data[i + length]) ++length;
+					if (length > bestLength) {
+						bestLength = length;
+						bestDistance = static_cast<int>(distance);
+						if (length == maxLength) break;
+					}
+				}
+				const std::int32_t next = state.chain[candidate & (deflateWindow - 1)];
+				if (next >= candidate) break;
+				candidate = next;
+			}
+		}
+
+		if (bestLength >= deflateMinMatch) {
+			const int lengthSymbol = tables.lengthSymbol[bestLength];
+			writer.put(tables.literalCode[257 + lengthSymbol], tables.literalLength[257 + lengthSymbol]);
+			writer.put(bestLength - tables.lengthBase[lengthSymbol], tables.lengthExtra[lengthSymbol]);
+			int distanceSymbol = 29;
+			while (tables.distanceBase[distanceSymbol] > bestDistance) --distanceSymbol;
+			writer.put(tables.distanceCode[distanceSymbol], 5);
+			writer.put(bestDistance - tables.distanceBase[distanceSymbol], tables.distanceExtra[distanceSymbol]);
+			for (int k = 0; k < bestLength; ++k) insert(i + k);
+			i += bestLength;
+		}
+		else {
+			writer.put(tables.literalCode[data[i]], tables.literalLength[data[i]]);
+			insert(i);
+			++i;
+		}
+	}
+	writer.put(tables.literalCode[256], tables.literalLength[256]);
+	if (!last) {
+		// // EMPTY STORED BLOCK: header, byte alignment, LEN = 0 and NLEN = 0xFFFF.
+		writer.put(0, 3);
+		writer.align();
+		writer.put(0xFFFF0000u, 32);
+	}
+	writer.align();
+}
+
+enum pngFilter { filterNone = 0, filterSub = 1, filterUp = 2, filterPaeth = 4 };
+
+// Filters one row of length bytes into out and returns the sum of the filtered bytes taken as signed
+// magnitudes, the usual estimate of how well the row will compress. row and previous are preceded by
+// bpp zero bytes, so the left neighbours of the first pixel read as 0, and previous is all zero for the
+// first row of the image. Every input is known in advance, so unlike decoding all 16 bytes of a vector
+// are filtered at once, Paeth included.
+template <int Filter>
+std::uint64_t filterRow(const std::uint8_t* row, const std::uint8_t* previous, std::uint8_t* out, int length, int bpp) {
+	std::uint64_t cost = 0;
+	int i = 0;
+#if DRAW_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sums = zero;
+	for (; i + 16 <= length; i += 16) {
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i - bpp));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(previous + i));
+		__m128i filtered;
+		if (Filter == filterSub) filtered = _mm_sub_epi8(x, a);
+		else if (Filter == filterUp) filtered = _mm_sub_epi8(x, b);
+		else if (Filter == filterNone) filtered = x;
+		else {
+			const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(previous + i - bpp));
+			__m128i predictor[2];
+			for (int half = 0; half < 2; ++half) {
+				const __m128i a16 = half ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+				const __m128i b16 = half ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+				const __m128i c16 = half ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+				const __m128i toA = _mm_sub_epi16(b16, c16), toB = _mm_sub_epi16(a16, c16), toC = _mm_add_epi16(toA, toB);
+				const __m128i pa = _mm_max_epi16(toA, _mm_sub_epi16(zero, toA));
+				const __m128i pb = _mm_max_epi16(toB, _mm_sub_epi16(zero, toB));
+				const __m128i pc = _mm_max_epi16(toC, _mm_sub_epi16(zero, toC));
+				// Take a when pa <= pb and pa <= pc, else b when pb <= pc, else c.
+				const __m128i notA = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+				const __m128i takeB = _mm_andnot_si128(_mm_cmpgt_epi16(pb, pc), notA);
+				const __m128i takeC = _mm_andnot_si128(takeB, notA);
+				predictor[half] = _mm_or_si128(_mm_andnot_si128(notA, a16), _mm_or_si128(_mm_and_si128(takeB, b16), _mm_and_si128(takeC, c16)));
+			}
+			filtered = _mm_sub_epi8(x, _mm_packus_epi16(predictor[0], predictor[1]));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), filtered);
+		// |filtered| as a signed byte is the smaller of filtered and -filtered as unsigned bytes.
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_min_epu8(filtered, _mm_sub_epi8(zero, filtered)), zero));
+	}
+	cost = static_cast<std::uint64_t>(_mm_cvtsi128_si32(sums)) + static_cast<std::uint64_t>(_mm_cvtsi128_si32(_mm_srli_si128(sums, 8)));
+#endif
+	for (; i < length; ++i) {
+		const int a = row[i - bpp], b = previous[i], c = previous[i - bpp];
+		int predictor = 0;
+		if (Filter == filterSub) predictor = a;
+		else if (Filter == filterUp) predictor = b;
+		else if (Filter == filterPaeth) {
+			const int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+			predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+		}
+		out[i] = static_cast<std::uint8_t>(row[i] - predictor);
+		cost += out[i] < 128 ? out[i] : 256 - out[i];
+	}
+	return cost;
+}
+
+// Rows of about this many bytes go into one strip, so strips are big enough for the 32K deflate window
+// and there are enough of them to keep every thread busy on large images.
+const std::size_t pngStripBytes = 256 * 1024;
+
+// Writes image as a PNG: RGBA for ARGB8888 canvases, gray for index8 and RGB otherwise. The image is cut
+// into strips of rows that numThreads workers filter and deflate independently; each compressed strip
+// goes out as its own IDAT chunk, and together the chunks form one zlib stream. Its Adler-32 is combined
+// from the checksums of the strips. numThreads of 0 uses one worker per CPU.
+bool writePNG(const canvas &image, const std::string &path, int numThreads = 0) {
+	int bpp, colorType;
+	rowConverter convert = nullptr;
+	switch (image.format) {
+	case pixelFormat::argb8888: bpp = 4; colorType = 6; convert = swizzleToRGBA; break;
+	case pixelFormat::rgb565: bpp = 3; colorType = 2; convert = expandRGB565; break;
+	case pixelFormat::rgb24: bpp = 3; colorType = 2; break;
+	default: bpp = 1; colorType = 0; break;
+	}
+	const int rowBytes = image.width * bpp;
+	const int stripRows = std::max<int>(1, static_cast<int>(pngStripBytes / (rowBytes + 1)));
+	const int numStrips = std::max(1, (image.height + stripRows - 1) / stripRows);
+	if (numThreads <= 0) numThreads = SDL_GetCPUCount();
+	numThreads = std::max(1, std::min(numThreads, numStrips));
+
+	// // FILTER AND DEFLATE THE STRIPS
+	std::vector<std::vector<std::uint8_t>> compressed(numStrips);
+	std::vector<std::uint32_t> adlers(numStrips), crcs(numStrips);
+	std::vector<std::size_t> filteredSizes(numStrips);
+	std::atomic<int> nextStrip(0);
+	auto work = [&]() {
+		// Rows are read through buffers with bpp zero bytes in front and 16 spare bytes behind.
+		std::vector<std::uint8_t> rows[2] = { std::vector<std::uint8_t>(rowBytes + 32), std::vector<std::uint8_t>(rowBytes + 32) };
+		std::vector<std::uint8_t> candidates[4] = { std::vector<std::uint8_t>(rowBytes + 16), std::vector<std::uint8_t>(rowBytes + 16),
+			std::vector<std::uint8_t>(rowBytes + 16), std::vector<std::uint8_t>(rowBytes + 16) };
+		std::vector<std::uint8_t> filtered;
+		deflateState state;
+		auto loadRow = [&](int row, std::vector<std::uint8_t> &buffer) {
+			const std::uint8_t* source = image.pixels + static_cast<std::ptrdiff_t>(row) * image.pitch;
+			if (convert) convert(source, buffer.data() + 16, image.width);
+			else std::memcpy(buffer.data() + 16, source, rowBytes);
+		};
+		for (int strip = nextStrip++; strip < numStrips; strip = nextStrip++) {
+			const int firstRow = strip * stripRows;
+			const int lastRow = std::min(image.height, firstRow + stripRows);
+			std::uint8_t* current = rows[0].data() + 16;
+			std::uint8_t* previous = rows[1].data() + 16;
+			if (firstRow > 0) loadRow(firstRow - 1, rows[1]);
+			else std::fill(rows[1].begin(), rows[1].end(), std::uint8_t(0));
+			filtered.resize(static_cast<std::size_t>(lastRow - firstRow) * (rowBytes + 1));
+			std::uint8_t* out = filtered.data();
+			for (int row = firstRow; row < lastRow; ++row) {
+				loadRow(row, (current == rows[0].data() + 16) ? rows[0] : rows[1]);
+				const std::uint64_t costs[4] = {
+					filterRow<filterNone>(current, previous, candidates[0].data(), rowBytes, bpp),
+					filterRow<filterSub>(current, previous, candidates[1].data(), rowBytes, bpp),
+					filterRow<filterUp>(current, previous, candidates[2].data(), rowBytes, bpp),
+					filterRow<filterPaeth>(current, previous, candidates[3].data(), rowBytes, bpp) };
+				const int best = static_cast<int>(std::min_element(costs, costs + 4) - costs);
+				*out++ = static_cast<std::uint8_t>(best == 3 ? filterPaeth : best);
+				std::memcpy(out, candidates[best].data(), rowBytes);
+				out += rowBytes;
+				std::swap(current, previous);
+			}
+			adlers[strip] = adler32(1, filtered.data(), filtered.size());
+			filteredSizes[strip] = filtered.size();
+			deflateStrip(filtered.data(), filtered.size(), strip == numStrips - 1, state, compressed[strip]);
+			crcs[strip] = crc32(crc32(0, reinterpret_cast<const std::uint8_t*>("IDAT"), 4), compressed[strip].data(), compressed[strip].size());
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int worker = 1; worker < numThreads; ++worker) workers.emplace_back(work);
+	work();
+	for (auto &thread : workers) thread.join();
+
+	std::uint32_t adler = adlers[0];
+	for (int strip = 1; strip < numStrips; ++strip) adler = adler32Combine(adler, adlers[strip], filteredSizes[strip]);
+
+	// // WRITE THE CHUNKS
+	imageStream stream;
+	if (!openImageStream(stream, path)) return false;
+	auto chunk = [&](const char* type, const std::uint8_t* data, std::uint32_t size, std::uint32_t crc) {
+		std::uint8_t* out = stageBytes(stream, 8);
+		for (int i = 0; i < 4; ++i) *out++ = static_cast<std::uint8_t>(size >> (24 - 8 * i));
+		std::memcpy(out, type, 4);
+		if (size > 0) streamBytes(stream, data, size);
+		out = stageBytes(stream, 4);
+		for (int i = 0; i < 4; ++i) *out++ = static_cast<std::uint8_t>(crc >> (24 - 8 * i));
+	};
+	auto chunkCRC = [](const char* type, const std::uint8_t* data, std::uint32_t size) {
+		return crc32(crc32(0, reinterpret_cast<const std::uint8_t*>(type), 4), data, size);
+	};
+	static const std::uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	streamBytes(stream, signature, 8);
+
+	std::uint8_t header[13] = {};
+	for (int i = 0; i < 4; ++i) {
+		header[i] = static_cast<std::uint8_t>(image.width >> (24 - 8 * i));
+		header[4 + i] = static_cast<std::uint8_t>(image.height >> (24 - 8 * i));
+	}
+	header[8] = 8;
+	header[9] = static_cast<std::uint8_t>(colorType);
+	chunk("IHDR", header, 13, chunkCRC("IHDR", header, 13));
+
+	// zlib header: deflate with a 32K window, no dictionary, fastest compression.
+	static const std::uint8_t zlibHeader[2] = { 0x78, 0x01 };
+	chunk("IDAT", zlibHeader, 2, chunkCRC("IDAT", zlibHeader, 2));
+	for (int strip = 0; strip < numStrips; ++strip) {
+		chunk("IDAT", compressed[strip].data(), static_cast<std::uint32_t>(compressed[strip].size()), crcs[strip]);
+	}
+	const std::uint8_t trailer[4] = { static_cast<std::uint8_t>(adler >> 24), static_cast<std::uint8_t>(adler >> 16),
+		static_cast<std::uint8_t>(adler >> 8), static_cast<std::uint8_t>(adler) };
+	chunk("IDAT", trailer, 4, chunkCRC("IDAT", trailer, 4));
+	chunk("IEND", nullptr, 0, chunkCRC("IEND", nullptr, 0));
+	return closeImageStream(stream, path);
+}
+
+
+// // SCENE FILES // //
+
+// Scenes are text with one command per line; # starts a comment and colors are hex ARGB.
+//   size <width> <height>                            canvas size, before anything is drawn
+//   clear <color>                                    fills the canvas
+//   color <color>                                    color of the commands that follow
+//   pixel <x> <y>
+//   line <x0> <y0> <x1> <y1>                         runs of lines are drawn as one batch
+//   aa <x0> <y0> <x1> <y1>
+//   thick <x0> <y0> <x1> <y1> <width> [butt|square|round]
+//   polyline <x0> <y0> <x1> <y1> ...
+// Scenes start from a white canvas of defaultSceneSize pixels square, and may be sized up to
+// maxSceneSize pixels a side.
+const int defaultSceneSize = 256;
+const int maxSceneSize = 16384;
+const std::uint32_t sceneBackground = 0xFFFFFFFF;
+
+// Reads a whole file into text. Sets the SDL error and returns false when it can't.
+bool readFile(const std::string &path, std::string &text) {
+	SDL_RWops* file = SDL_RWFromFile(path.c_str(), "rb");
+	if (file == nullptr) return false;
+	const Sint64 size = SDL_RWsize(file);
+	text.resize(size > 0 ? static_cast<std::size_t>(size) : 0);
+	const bool read = text.empty() || SDL_RWread(file, &text[0], text.size(), 1) == 1;
+	SDL_RWclose(file);
+	if (!read) SDL_SetError("Can't read %s", path.c_str());
+	return read;
+}
+
+// Splits one line of a scene into words, dropping comments.
+void splitWords(const char* first, const char* last, std::vector<std::string> &words) {
+	words.clear();
+	while (first != last && *first != '#') {
+		if (*first == ' ' || *first == '\t' || *first == '\r') {
+			++first;
+			continue;
+		}
+		const char* end = first;
+		while (end != last && *end != ' ' && *end != '\t' && *end != '\r' && *end != '#') ++end;
+		words.emplace_back(first, end);
+		first = end;
+	}
+}
+
+bool parseInt(const std::string &word, int &value) {
+	char* end;
+	const long parsed = std::strtol(word.c_str(), &end, 10);
+	value = static_cast<int>(parsed);
+	return !word.empty() && *end == '\0';
+}
+
+bool parseColor(const std::string &word, std::uint32_t &color) {
+	char* end;
+	color = static_cast<std::uint32_t>(std::strtoul(word.c_str(), &end, 16));
+	return !word.empty() && *end == '\0';
+}
+
+// Draws the scene in text into target, first resizing target to the scene's size. target is reused
+// when the size is unchanged, so a worker rendering many scenes allocates once. Returns false with
+// the SDL error set when the scene doesn't parse.
+bool renderScene(const std::string &text, canvas &target) {
+	std::vector<std::string> words;
+	std::vector<int> numbers;
+	std::vector<coordinate> points;
+	lineBuffer lines;
+	std::uint32_t color = 0xFF000000;
+	bool sized = false;
+	int lineNumber = 0;
+
+	auto ensureCanvas = [&](int width, int height) {
+		if (target.pixels == nullptr || target.width != width || target.height != height) {
+			destroyCanvas(target);
+			target = createCanvas(width, height);
+		}
+		sized = true;
+		if (target.pixels == nullptr) return false;
+		fillRect({ 0, 0, width, height }, sceneBackground, target);
+		return true;
+	};
+	auto flushLines = [&]() {
+		drawLines(lines, target);
+		lines.clear();
+	};
+
+	const char* next = text.c_str();
+	const char* end = next + text.size();
+	while (next != end) {
+		const char* lineEnd = std::find(next, end, '\n');
+		splitWords(next, lineEnd, words);
+		next = lineEnd == end ? end : lineEnd + 1;
+		++lineNumber;
+		if (words.empty()) continue;
+
+		// Integer arguments up to the first word that isn't one.
+		const std::string &command = words[0];
+		const std::size_t numArguments = words.size() - 1;
+		numbers.clear();
+		int value;
+		while (numbers.size() < numArguments && parseInt(words[numbers.size() + 1], value)) numbers.push_back(value);
+
+		if (command == "size" && numArguments == 2 && numbers.size() == 2 && !sized && numbers[0] > 0 && numbers[1] > 0) {
+			if (numbers[0] > maxSceneSize || numbers[1] > maxSceneSize) {
+				SDL_SetError("Size on line %d is over %d pixels a side: %dx%d", lineNumber, maxSceneSize, numbers[0], numbers[1]);
+				return false;
+			}
+			if (!ensureCanvas(numbers[0], numbers[1])) return false;
+			continue;
+		}
+		if (!sized && !ensureCanvas(defaultSceneSize, defaultSceneSize)) return false;
+		if (command != "line" && lines.size() > 0) flushLines();
+
+		bool valid = true;
+		if (command == "line" && numArguments == 4 && numbers.size() == 4) {
+			lines.push_back({ { numbers[0], numbers[1] }, { numbers[2], numbers[3] } }, color);
+		}
+		else if (command == "clear" && numArguments == 1) {
+			std::uint32_t fill;
+			valid = parseColor(words[1], fill);
+			if (valid) fillRect({ 0, 0, target.width, target.height }, fill, target);
+		}
+		else if (command == "color" && numArguments == 1) {
+			valid = parseColor(words[1], color);
+		}
+		else if (command == "pixel" && numArguments == 2 && numbers.size() == 2) {
+			drawPixel({ numbers[0], numbers[1] }, color, target);
+		}
+		else if (command == "aa" && numArguments == 4 && numbers.size() == 4) {
+			drawLineAA({ { numbers[0], numbers[1] }, { numbers[2], numbers[3] } }, color, target);
+		}
+		else if (command == "thick" && (numArguments == 5 || numArguments == 6) && numbers.size() == 5) {
+			lineCap cap = lineCap::butt;
+			if (numArguments == 6) {
+				if (words[6] == "square") cap = lineCap::square;
+				else if (words[6] == "round") cap = lineCap::round;
+				else valid = words[6] == "butt";
+			}
+			if (valid) drawThickLine({ { numbers[0], numbers[1] }, { numbers[2], numbers[3] } }, numbers[4], cap, color, target);
+		}
+		else if (command == "polyline" && numbers.size() == numArguments && numArguments >= 2 && numArguments % 2 == 0) {
+			points.clear();
+			for (std::size_t i = 0; i < numbers.size(); i += 2) points.push_back({ numbers[i], numbers[i + 1] });
+			drawPolyline(points.data(), points.size(), color, target);
+		}
+		else valid = false;
+
+		if (!valid) {
+			SDL_SetError("Bad command on line %d: %s", lineNumber, command.c_str());
+			return false;
+		}
+	}
+	if (!sized && !ensureCanvas(defaultSceneSize, defaultSceneSize)) return false;
+	if (lines.size() > 0) flushLines();
+	return true;
+}
+
+
+// // BATCH RENDERING // //
+
+// Extension of scene files picked up from a directory.
+const char* const sceneExtension = ".scene";
+
+bool endsWith(const std::string &text, const std::string &suffix) {
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Lists the scene files in directory, sorted by name. Returns false when path is not a directory.
+bool listSceneDirectory(const std::string &directory, std::vector<std::string> &paths) {
+#if defined(_WIN32)
+	WIN32_FIND_DATAA found;
+	HANDLE search = FindFirstFileA((directory + "\\*" + sceneExtension).c_str(), &found);
+	if (search == INVALID_HANDLE_VALUE) return GetFileAttributesA(directory.c_str()) != INVALID_FILE_ATTRIBUTES &&
+		(GetFileAttributesA(directory.c_str()) & FILE_ATTRIBUTE_DIRECTORY);
+	do {
+		if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) paths.push_back(directory + "/" + found.cFileName);
+	} while (FindNextFileA(search, &found));
+	FindClose(search);
+#else
+	DIR* listing = opendir(directory.c_str());
+	if (listing == nullptr) return false;
+	while (dirent* entry = readdir(listing)) {
+		const std::string name = entry->d_name;
+		if (endsWith(name, sceneExtension)) paths.push_back(directory + "/" + name);
+	}
+	closedir(listing);
+#endif
+	std::sort(paths.begin(), paths.end());
+	return true;
+}
+
+// Scene paths from a directory of scene files, or from a manifest listing one path per line. Relative
+// paths in a manifest are taken as they are, relative to the working directory.
+bool listScenes(const std::string &source, std::vector<std::string> &paths) {
+	if (listSceneDirectory(source, paths)) return true;
+	std::string manifest;
+	if (!readFile(source, manifest)) return false;
+	std::vector<std::string> words;
+	const char* next = manifest.c_str();
+	const char* end = next + manifest.size();
+	while (next != end) {
+		const char* lineEnd = std::find(next, end, '\n');
+		splitWords(next, lineEnd, words);
+		if (!words.empty()) paths.push_back(words[0]);
+		next = lineEnd == end ? end : lineEnd + 1;
+	}
+	return true;
+}
+
+// Output file for a scene: its name without directory or extension, in outputDirectory.
+std::string outputPath(const std::string &scenePath, const std::string &outputDirectory, const char* extension) {
+	const std::size_t slash = scenePath.find_last_of("/\\");
+	std::string name = slash == std::string::npos ? scenePath : scenePath.substr(slash + 1);
+	const std::size_t dot = name.find_last_of('.');
+	if (dot != std::string::npos && dot > 0) name.resize(dot);
+	return outputDirectory + "/" + name + extension;
+}
+
+// Writes image in the format named by the extension of path: .bmp, .ppm, .pam or .png. numThreads
+// is passed on to the PNG encoder.
+bool saveCanvas(const canvas &image, const std::string &path, int numThreads = 0) {
+	if (endsWith(path, ".png")) return writePNG(image, path, numThreads);
+	if (endsWith(path, ".bmp")) return writeBMP(image, path);
+	if (endsWith(path, ".ppm")) return writePPM(image, path);
+	if (endsWith(path, ".pam")) return writePAM(image, path);
+	SDL_SetError("Unknown image format for %s", path.c_str());
+	return false;
+}
+
+// Renders every scene on numThreads workers and writes one image per scene into outputDirectory, in the
+// format of extension.
+// Each worker keeps one canvas for all its jobs and takes the next scene from a shared counter.
+// Prints scenes per second and returns the number of scenes that failed.
+int renderBatch(const std::string &source, const std::string &outputDirectory, int numThreads = 0, const char* extension = ".bmp") {
+	std::vector<std::string> scenes;
+	if (!listScenes(source, scenes)) {
+		SDL_Log("Can't list scenes in %s: %s", source.c_str(), SDL_GetError());
+		return 1;
+	}
+	if (numThreads <= 0) numThreads = SDL_GetCPUCount();
+	numThreads = std::max(1, std::min<int>(numThreads, static_cast<int>(scenes.size())));
+
+	std::atomic<std::size_t> nextScene(0);
+	std::atomic<int> failed(0);
+	const Uint64 start = SDL_GetPerformanceCounter();
+	std::vector<std::thread> workers;
+	for (int worker = 0; worker < numThreads; ++worker) {
+		workers.emplace_back([&]() {
+			canvas image = canvasFromPixels(nullptr, 0, 0, 0);
+			std::string text;
+			for (std::size_t i = nextScene++; i < scenes.size(); i = nextScene++) {
+				const std::string output = outputPath(scenes[i], outputDirectory, extension);
+				// Workers already run in parallel, so each encodes its own images on one thread.
+				if (!readFile(scenes[i], text) || !renderScene(text, image) || !saveCanvas(image, output, 1)) {
+					SDL_Log("%s: %s", scenes[i].c_str(), SDL_GetError());
+					++failed;
+				}
+			}
+			destroyCanvas(image);
+		});
+	}
+	for (auto &thread : workers) thread.join();
+	const double seconds = static_cast<double>(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+	if (scenes.empty()) {
+		std::cout << "No scenes in " << source << std::endl;
+		return 0;
+	}
+	std::cout << scenes.size() - failed << " of " << scenes.size() << " scenes rendered in " << seconds << " s on " << numThreads
+		<< " threads: " << scenes.size() / seconds << " scenes/sec" << std::endl;
+	return failed;
+}
+
+
+// // MAPPED CANVASES // //
+
+// A canvas whose pixels are a memory-mapped image file. The file is laid out as a finished BMP or PAM
+// before drawing starts, so drawing writes straight into the page cache and the image is complete once
+// the mapping is flushed. Canvases too big for memory are paged in and out by the system.
+struct canvasFile {
+	canvas target;
+	std::string path;
+	std::uint8_t* base;
+	std::size_t size;
+#if defined(_WIN32)
+	HANDLE file, mapping;
+#else
+	int file;
+#endif
+};
+
+// Pixel data starts on a cache line, so row starts are as aligned as the file format allows.
+const std::uint32_t canvasFileAlignment = 64;
+
+// Creates path as a width by height image in format and maps it as target, cleared to 0. The extension
+// picks the layout: .bmp holds ARGB8888, RGB565 and index8 rows as they are in memory, .pam holds RGB24
+// and index8. PAM headers are padded with a comment to align the pixels. Returns false, with the SDL
+// error set, if the size or format can't be stored in that layout or the file can't be mapped; a file
+// that was created is deleted again.
+bool openCanvasFile(canvasFile &mapped, const std::string &path, int width, int height, pixelFormat format = pixelFormat::argb8888) {
+	if (width <= 0 || height <= 0 || width > std::numeric_limits<int>::max() / 4 - 3) {
+		SDL_SetError("Can't map a %dx%d canvas", width, height);
+		return false;
+	}
+	const bool bmp = endsWith(path, ".bmp");
+	const bool pam = endsWith(path, ".pam");
+	if ((bmp && format == pixelFormat::rgb24) || (pam && format != pixelFormat::rgb24 && format != pixelFormat::index8) || (!bmp && !pam)) {
+		SDL_SetError("Can't map a canvas of this pixel format as %s", path.c_str());
+		return false;
+	}
+
+	// // LAY OUT THE HEADER
+	std::vector<std::uint8_t> header;
+	int pitch;
+	if (bmp) {
+		header.resize((bmpHeaderSize(format) + canvasFileAlignment - 1) / canvasFileAlignment * canvasFileAlignment);
+		putBMPHeader(header.data(), width, height, format, static_cast<std::uint32_t>(header.size()));
+		pitch = bmpStride(width, format);
+	}
+	else {
+		// "#\n" after the magic number, widened with spaces until the pixels start aligned.
+		char text[128];
+		const int length = formatPAMHeader(text, sizeof(text), width, height, format);
+		header.resize((length + 2 + canvasFileAlignment - 1) / canvasFileAlignment * canvasFileAlignment, ' ');
+		const std::size_t comment = header.size() - length;
+		std::memcpy(header.data(), text, 3);
+		header[3] = '#';
+		header[3 + comment - 1] = '\n';
+		std::memcpy(header.data() + 3 + comment, text + 3, length - 3);
+		pitch = width * bytesPerPixel(format);
+	}
+
+	// // CHECK THE FILE FITS THE ADDRESS SPACE, AND ON POSIX off_t, BEFORE CREATING IT
+	const std::uint64_t size = header.size() + static_cast<std::uint64_t>(pitch) * height;
+	bool fits = size <= std::numeric_limits<std::size_t>::max();
+#if !defined(_WIN32)
+	fits = fits && size <= static_cast<std::uint64_t>(std::numeric_limits<off_t>::max());
+#endif
+	if (!fits) {
+		SDL_SetError("A %dx%d canvas is too large to map", width, height);
+		return false;
+	}
+	mapped.path = path;
+	mapped.size = static_cast<std::size_t>(size);
+
+	// // CREATE AND MAP THE FILE
+#if defined(_WIN32)
+	mapped.file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mapped.file == INVALID_HANDLE_VALUE) {
+		SDL_SetError("Can't create %s", path.c_str());
+		return false;
+	}
+	mapped.mapping = CreateFileMappingA(mapped.file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+	mapped.base = mapped.mapping ? static_cast<std::uint8_t*>(MapViewOfFile(mapped.mapping, FILE_MAP_WRITE, 0, 0, 0)) : nullptr;
+	if (mapped.base == nullptr) {
+		if (mapped.mapping) CloseHandle(mapped.mapping);
+		CloseHandle(mapped.file);
+		DeleteFileA(path.c_str());
+		SDL_SetError("Can't map %s", path.c_str());
+		return false;
+	}
+#else
+	mapped.file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (mapped.file < 0) {
+		SDL_SetError("Can't create %s", path.c_str());
+		return false;
+	}
+	// The file grows as a hole, so pixels never drawn take no disk space.
+	void* base = ftruncate(mapped.file, static_cast<off_t>(mapped.size)) == 0
+		? mmap(nullptr, mapped.size, PROT_READ | PROT_WRITE, MAP_SHARED, mapped.file, 0) : MAP_FAILED;
+	if (base == MAP_FAILED) {
+		close(mapped.file);
+		unlink(path.c_str());
+		SDL_SetError("Can't map %s", path.c_str());
+		return false;
+	}
+	mapped.base = static_cast<std::uint8_t*>(base);
+#endif
+	std::memcpy(mapped.base, header.data(), header.size());
+	mapped.target = canvasFromPixels(mapped.base + header.size(), width, height, pitch, format);
+	return true;
+}
+
+// Writes the pages drawn so far back to the file and waits for them, so a long render can be
+// checkpointed without closing it.
+bool flushCanvasFile(canvasFile &mapped) {
+#if defined(_WIN32)
+	const bool flushed = FlushViewOfFile(mapped.base, 0) && FlushFileBuffers(mapped.file);
+#else
+	const bool flushed = msync(mapped.base, mapped.size, MS_SYNC) == 0;
+#endif
+	if (!flushed) SDL_SetError("Can't write %s", mapped.path.c_str());
+	return flushed;
+}
+
+// Flushes the image and unmaps it; target must not be drawn afterwards. Returns false, with the SDL
+// error set, if the file could not be written.
+bool closeCanvasFile(canvasFile &mapped) {
+	const bool flushed = flushCanvasFile(mapped);
+#if defined(_WIN32)
+	UnmapViewOfFile(mapped.base);
+	CloseHandle(mapped.mapping);
+	const bool closed = CloseHandle(mapped.file) != 0;
+#else
+	munmap(mapped.base, mapped.size);
+	const bool closed = close(mapped.file) == 0;
+#endif
+	mapped.target = canvasFromPixels(nullptr, 0, 0, 0);
+	if (flushed && !closed) SDL_SetError("Can't write %s", mapped.path.c_str());
+	return flushed && closed;
+}
+
+
+// // BENCHMARK // //
+
+// Draws lines with each engine and prints pixels per second.
+void benchmarkEngines(const char* label, const std::vector<line> &lines, const canvas &target) {
+	const std::pair<lineEngine, const char*> engines[] = {
+		{ lineEngine::reference, "reference" },
+		{ lineEngine::bresenham, "bresenham" },
+		{ lineEngine::runSlice, "run-slice" },
+	};
+	long long numPixels = 0;
+	for (const auto &lineA : lines) {
+		numPixels += std::max(std::abs(lineA.end.x - lineA.start.x), std::abs(lineA.end.y - lineA.start.y));
+	}
+
+	std::cout << label << ":";
+	const auto previousEngine = s_lineEngine;
+	for (const auto &engine : engines) {
+		s_lineEngine = engine.first;
+		const Uint64 begin = SDL_GetPerformanceCounter();
+		for (const auto &lineA : lines) {
+			drawLine(lineA, 0xFFFF0000, target);
+		}
+		const double seconds = double(SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency();
+		std::cout << "  " << engine.second << " " << numPixels / seconds / 1e6 << " Mpixels/sec";
+	}
+	std::cout << std::endl;
+	s_lineEngine = previousEngine;
+}
+
+// Benchmarks random long lines, then a sweep of slopes from near horizontal to diagonal.
+void benchmarkLines(int numLines, int minLength) {
+	canvas target = createCanvas(1280, 720);
+	std::vector<line> lines;
+	std::srand(1);
+	while (static_cast<int>(lines.size()) < numLines) {
+		line tempLine;
+		tempLine.start.x = 1 + std::rand() % (target.width - 1);
+		tempLine.start.y = 1 + std::rand() % (target.height - 1);
+		tempLine.end.x = 1 + std::rand() % (target.width - 1);
+		tempLine.end.y = 1 + std::rand() % (target.height - 1);
+		const int length = std::max(std::abs(tempLine.end.x - tempLine.start.x), std::abs(tempLine.end.y - tempLine.start.y));
+		if (length < minLength) continue;
+		lines.push_back(tempLine);
+	}
+	benchmarkEngines("random", lines, target);
+	canvas target565 = createCanvas(target.width, target.height, pixelFormat::rgb565);
+	benchmarkEngines("random rgb565", lines, target565);
+	destroyCanvas(target565);
+
+	const int rises[] = { 0, 4, 16, 64, 128, 256, 384, 512, 640 };
+	for (int deltaY : rises) {
+		lines.clear();
+		for (int i = 0; i < numLines; ++i) {
+			line tempLine;
+			tempLine.start.x = 100;
+			tempLine.start.y = 1 + std::rand() % (target.height - 1 - deltaY);
+			tempLine.end.x = 1124;
+			tempLine.end.y = tempLine.start.y + deltaY;
+			if (i & 1) std::swap(tempLine.start.y, tempLine.end.y);
+			lines.push_back(tempLine);
+		}
+		const std::string label = "slope " + std::to_string(deltaY) + "/1024";
+		benchmarkEngines(label.c_str(), lines, target);
+	}
+	destroyCanvas(target);
+}
+
+// Draws many short segments one drawLine call at a time, then as one drawLines batch from an array and from a lineBuffer.
+void benchmarkBatch(int numLines, int maxLength) {
+	canvas target = createCanvas(1280, 720);
+	std::vector<line> lines(numLines);
+	for (auto &lineA : lines) {
+		lineA.start.x = std::rand() % target.width;
+		lineA.start.y = std::rand() % target.height;
+		lineA.end.x = lineA.start.x + std::rand() % (2 * maxLength + 1) - maxLength;
+		lineA.end.y = lineA.start.y + std::rand() % (2 * maxLength + 1) - maxLength;
+	}
+
+	Uint64 begin = SDL_GetPerformanceCounter();
+	for (const auto &lineA : lines) {
+		drawLine(lineA, 0xFFFF0000, target);
+	}
+	const double single = double(SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency();
+
+	begin = SDL_GetPerformanceCounter();
+	drawLines(lines.data(), lines.size(), 0xFFFF0000, target);
+	const double batched = double(SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency();
+
+	lineBuffer buffer;
+	buffer.reserve(lines.size());
+	for (const auto &lineA : lines) buffer.push_back(lineA);
+	begin = SDL_GetPerformanceCounter();
+	drawLines(buffer, 0xFFFF0000, target);
+	const double buffered = double(SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency();
+
+	std::cout << "segments up to " << maxLength << "px:  drawLine " << numLines / single / 1e6 << " Mlines/sec  drawLines "
+		<< numLines / batched / 1e6 << " Mlines/sec  lineBuffer " << numLines / buffered / 1e6 << " Mlines/sec" << std::endl;
+	destroyCanvas(target);
+}
+
+// Draws long lines with drawLine on one thread, then with drawLinesParallel.
+void benchmarkParallel(int numLines) {
+	canvas target = createCanvas(1920, 1080);
+	lineBuffer lines;
+	lines.reserve(numLines);
+	for (int i = 0; i < numLines; ++i) {
+		line lineA;
+		lineA.start.x = std::rand() % target.width;
+		lineA.start.y = std::rand() % target.height;
+		lineA.end.x = std::rand() % target.width;
+		lineA.end.y = std::rand() % target.height;
+		lines.push_back(lineA);
+	}
+
+	Uint64 begin = SDL_GetPerformanceCounter();
+	for (std::size_t i = 0; i < lines.size(); ++i) {
+		drawLine(lines.get(i), 0xFFFF0000, target);
+	}
+	const double single = double(SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency();
+
+	begin = SDL_GetPerformanceCounter();
+	drawLinesParallel(lines, 0xFFFF0000, target);
+	const double parallel = double(SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency();
+
+	std::cout << "long lines:  drawLine " << numLines / single / 1e6 << " Mlines/sec  drawLinesParallel on " << SDL_GetCPUCount()
+		<< " threads " << numLines / parallel / 1e6 << " Mlines/sec" << std::endl;
+	destroyCanvas(target);
+}
+
+// // SWAP CHAIN // //
+
+// Buffers in a swap chain: one being drawn, one waiting to be presented and one on screen, so neither
+// the renderer nor the present thread ever waits for the other.
+const int swapChainLength = 3;
+
+struct swapBuffer {
+	canvas target;
+	damageTracker damage;   // drawn in this buffer's frame
+	damageTracker stale;    // drawn in later frames, to copy in before this buffer is drawn again
+	std::uint64_t frame;    // number of the frame last submitted in this buffer
+};
+
+// Triple-buffered window canvases. The renderer draws into back() and calls submitFrame; a present
+// thread copies the newest submitted frame to the window surface. Buffers change hands through the
+// single atomic ready slot, which holds a buffer index, plus readyFresh while nobody has presented it.
+// SDL's video functions may only be called from the thread that pumps events (on X11 the display
+// connection isn't thread-safe), so the present thread only copies pixels: it then posts uploadEvent
+// and waits until the event loop has passed it to uploadSwapChain before touching the surface again.
+struct swapChain {
+	static const int readyFresh = 4;
+	swapBuffer buffers[swapChainLength];
+	SDL_Window* window;
+	SDL_Surface* surface;
+	std::atomic<int> ready;
+	std::atomic<bool> exposed;  // set by representFrame until the present thread uploads the whole surface
+	std::atomic<bool> closing;
+	SDL_sem* wake;
+	SDL_sem* uploaded;
+	Uint32 uploadEvent;
+	SDL_Rect uploadRects[damageTracker::maxRects];
+	int numUploadRects;     // 0 uploads the whole surface
+	std::thread presenter;
+	int back;               // render side only
+	std::uint64_t frame;    // render side only
+
+	canvas &backBuffer() { return buffers[back].target; }
+};
+
+// Copies rect of source into the window surface, row by row.
+void copyToSurface(const canvas &source, const SDL_Rect &rect, SDL_Surface* surface) {
+	const int bytes = bytesPerPixel(source.format);
+	for (int row = rect.y; row < rect.y + rect.h; ++row) {
+		std::memcpy(static_cast<std::uint8_t*>(surface->pixels) + static_cast<std::ptrdiff_t>(row) * surface->pitch + rect.x * bytes,
+			source.pixels + static_cast<std::ptrdiff_t>(row) * source.pitch + rect.x * bytes, static_cast<std::size_t>(rect.w) * bytes);
+	}
+}
+
+// Asks the event loop to upload rects of the window surface, or all of it when count is 0, and waits
+// until it has. An event that can't be queued leaves that frame on the surface until the next upload.
+void requestUpload(swapChain &chain, const SDL_Rect* rects, int count) {
+	std::copy(rects, rects + count, chain.uploadRects);
+	chain.numUploadRects = count;
+	SDL_Event event = {};
+	event.type = chain.uploadEvent;
+	if (SDL_PushEvent(&event) == 1) SDL_SemWait(chain.uploaded);
+}
+
+// Present thread. A frame that directly follows the one on screen only copies and uploads its damage;
+// after skipped frames, or when the window was exposed, the whole surface is presented. A wake that
+// finds neither a new frame nor an expose request, left over from a frame an earlier wake already
+// took, uploads nothing.
+void presentFrames(swapChain &chain) {
+	int front = swapChainLength - 1;
+	std::uint64_t presented = 0;
+	const SDL_Rect whole = { 0, 0, chain.surface->w, chain.surface->h };
+	for (;;) {
+		SDL_SemWait(chain.wake);
+		if (chain.closing.load(std::memory_order_acquire)) return;
+		const bool exposed = chain.exposed.exchange(false, std::memory_order_relaxed);
+		if (!(chain.ready.load(std::memory_order_relaxed) & swapChain::readyFresh)) {
+			if (exposed) requestUpload(chain, nullptr, 0);
+			continue;
+		}
+		front = chain.ready.exchange(front, std::memory_order_acq_rel) & ~swapChain::readyFresh;
+		const swapBuffer &buffer = chain.buffers[front];
+		if (!exposed && buffer.frame == presented + 1 && buffer.damage.numRects > 0) {
+			for (int i = 0; i < buffer.damage.numRects; ++i) copyToSurface(buffer.target, buffer.damage.rects[i], chain.surface);
+			requestUpload(chain, buffer.damage.rects, buffer.damage.numRects);
+		}
+		else {
+			copyToSurface(buffer.target, whole, chain.surface);
+			requestUpload(chain, nullptr, 0);
+		}
+		presented = buffer.frame;
+	}
+}
+
+// Uploads the window surface when event is the present thread's request. Call it from the event loop
+// with every event; returns whether event was the request.
+bool uploadSwapChain(swapChain &chain, const SDL_Event &event) {
+	if (event.type != chain.uploadEvent) return false;
+	if (chain.numUploadRects > 0) SDL_UpdateWindowSurfaceRects(chain.window, chain.uploadRects, chain.numUploadRects);
+	else SDL_UpdateWindowSurface(chain.window);
+	SDL_SemPost(chain.uploaded);
+	return true;
+}
+
+// Creates the buffers from the window's current contents and starts the present thread. Returns false
+// when the window surface has a format the kernels can't draw. The window must not be resized while
+// the chain is open, since that would free the surface under the present thread.
+bool openSwapChain(swapChain &chain, SDL_Window* window) {
+	chain.window = window;
+	chain.surface = SDL_GetWindowSurface(window);
+	if (chain.surface == nullptr) return false;
+	chain.uploadEvent = SDL_RegisterEvents(1);
+	if (chain.uploadEvent == static_cast<Uint32>(-1)) {
+		SDL_SetError("Out of user events for swap chain");
+		return false;
+	}
+	pixelFormat format;
+	if (!pixelFormatFromSDL(chain.surface->format->format, format)) {
+		SDL_SetError("Unsupported pixel format %s", SDL_GetPixelFormatName(chain.surface->format->format));
+		return false;
+	}
+	for (int i = 0; i < swapChainLength; ++i) {
+		swapBuffer &buffer = chain.buffers[i];
+		buffer.target = createCanvas(chain.surface->w, chain.surface->h, format);
+		if (buffer.target.pixels == nullptr) {
+			for (int j = 0; j < i; ++j) destroyCanvas(chain.buffers[j].target);
+			SDL_SetError("Out of memory for swap chain");
+			return false;
+		}
+		for (int row = 0; row < chain.surface->h; ++row) {
+			std::memcpy(buffer.target.pixels + static_cast<std::ptrdiff_t>(row) * buffer.target.pitch,
+				static_cast<const std::uint8_t*>(chain.surface->pixels) + static_cast<std::ptrdiff_t>(row) * chain.surface->pitch,
+				static_cast<std::size_t>(chain.surface->w) * bytesPerPixel(format));
+		}
+		buffer.target.damage = &buffer.damage;
+		buffer.damage.clear();
+		buffer.stale.clear();
+		buffer.frame = 0;
+	}
+	chain.back = 0;
+	chain.frame = 0;
+	chain.ready.store(1, std::memory_order_relaxed);
+	chain.exposed.store(false, std::memory_order_relaxed);
+	chain.closing.store(false, std::memory_order_relaxed);
+	chain.wake = SDL_CreateSemaphore(0);
+	chain.uploaded = SDL_CreateSemaphore(0);
+	chain.presenter = std::thread(presentFrames, std::ref(chain));
+	return true;
+}
+
+// Hands the back buffer to the present thread and takes back the buffer it replaces, which is then
+// brought up to date by copying in whatever later frames drew. A frame that drew without recording
+// damage counts as redrawn everywhere.
+void submitFrame(swapChain &chain) {
+	swapBuffer &submitted = chain.buffers[chain.back];
+	if (submitted.damage.numRects == 0) submitted.damage.add({ 0, 0, submitted.target.width, submitted.target.height });
+	for (int i = 0; i < swapChainLength; ++i) {
+		if (i == chain.back) continue;
+		for (int r = 0; r < submitted.damage.numRects; ++r) chain.buffers[i].stale.add(submitted.damage.rects[r]);
+	}
+	submitted.frame = ++chain.frame;
+	const int latest = chain.back;
+	chain.back = chain.ready.exchange(latest | swapChain::readyFresh, std::memory_order_acq_rel) & ~swapChain::readyFresh;
+	SDL_SemPost(chain.wake);
+
+	// // CATCH THE NEW BACK BUFFER UP. The latest frame is only read by the present thread, so it can be read here too.
+	swapBuffer &next = chain.buffers[chain.back];
+	const int bytes = bytesPerPixel(next.target.format);
+	for (int r = 0; r < next.stale.numRects; ++r) {
+		const SDL_Rect &rect = next.stale.rects[r];
+		for (int row = rect.y; row < rect.y + rect.h; ++row) {
+			std::memcpy(next.target.pixels + static_cast<std::ptrdiff_t>(row) * next.target.pitch + rect.x * bytes,
+				chain.buffers[latest].target.pixels + static_cast<std::ptrdiff_t>(row) * next.target.pitch + rect.x * bytes,
+				static_cast<std::size_t>(rect.w) * bytes);
+		}
+	}
+	next.stale.clear();
+	next.damage.clear();
+}
+
+// Presents the frame on screen again, for when the window was exposed. Safe to call from any thread.
+void representFrame(swapChain &chain) {
+	chain.exposed.store(true, std::memory_order_relaxed);
+	SDL_SemPost(chain.wake);
+}
+
+// Stops the present thread, which may be waiting for an upload the event loop will no longer run.
+void closeSwapChain(swapChain &chain) {
+	chain.closing.store(true, std::memory_order_release);
+	SDL_SemPost(chain.wake);
+	SDL_SemPost(chain.uploaded);
+	chain.presenter.join();
+	SDL_FlushEvent(chain.uploadEvent);
+	SDL_DestroySemaphore(chain.wake);
+	SDL_DestroySemaphore(chain.uploaded);
+	for (int i = 0; i < swapChainLength; ++i) destroyCanvas(chain.buffers[i].target);
+}
+
+
+// // FRAME SCHEDULER // //
+
+// Frame times in milliseconds over the last frameHistoryLength frames, measured start to start.
+struct frameStats {
+	double minimum, average, p99;
+	double lastWork;          // time from beginFrame to endFrame of the latest frame
+	std::uint64_t overBudget; // frames whose work took longer than the budget
+};
+
+const int frameHistoryLength = 120;
+
+// Updates one frame may run to catch up. A frame that falls further behind drops the rest rather than
+// running ever more updates per frame.
+const int maxUpdatesPerFrame = 5;
+
+// Paces frames with SDL_GetPerformanceCounter. Updates run in fixed steps, as many as the time since the
+// last frame covers, so the simulation advances at updateRate whatever the frame rate; frames start every
+// frameInterval counts. All times are in performance counter counts.
+struct frameScheduler {
+	Uint64 frequency;
+	Uint64 updateStep;      // counts per fixed update, 0 when nothing animates
+	Uint64 frameInterval;   // counts per frame at the target frame rate
+	Uint64 budget;          // counts the work of one frame may take
+	Uint64 nextFrame;       // when the next frame is due
+	Uint64 frameStart;      // when the current frame began, 0 before the first frame
+	Uint64 accumulated;     // time not yet used up by updates
+	double history[frameHistoryLength];
+	int historySize, historyNext;
+	double lastWork;
+	std::uint64_t overBudget;
+};
+
+// updateRate and frameRate are in Hz. A frameRate of 0 draws a frame per update, and a budget of 0
+// gives each frame its whole interval. An updateRate of 0 makes a scheduler for a window that only
+// changes on events.
+frameScheduler createFrameScheduler(double updateRate, double frameRate = 0, double budgetMilliseconds = 0) {
+	frameScheduler scheduler = {};
+	scheduler.frequency = SDL_GetPerformanceFrequency();
+	const double frequency = static_cast<double>(scheduler.frequency);
+	scheduler.updateStep = updateRate > 0 ? static_cast<Uint64>(frequency / updateRate) : 0;
+	scheduler.frameInterval = frameRate > 0 ? static_cast<Uint64>(frequency / frameRate) : scheduler.updateStep;
+	scheduler.budget = budgetMilliseconds > 0 ? static_cast<Uint64>(frequency * budgetMilliseconds / 1000) : scheduler.frameInterval;
+	scheduler.nextFrame = SDL_GetPerformanceCounter();
+	return scheduler;
+}
+
+bool frameDue(const frameScheduler &scheduler) {
+	return SDL_GetPerformanceCounter() >= scheduler.nextFrame;
+}
+
+// Rounded up, so that waiting this long never wakes the loop just before the frame is due.
+int millisecondsToNextFrame(const frameScheduler &scheduler) {
+	const Uint64 now = SDL_GetPerformanceCounter();
+	if (now >= scheduler.nextFrame) return 0;
+	return static_cast<int>(((scheduler.nextFrame - now) * 1000 + scheduler.frequency - 1) / scheduler.frequency);
+}
+
+// Starts a frame and returns how many fixed updates it should run.
+int beginFrame(frameScheduler &scheduler) {
+	const Uint64 now = SDL_GetPerformanceCounter();
+	if (scheduler.frameStart != 0) {
+		const Uint64 elapsed = now - scheduler.frameStart;
+		scheduler.history[scheduler.historyNext] = elapsed * 1000.0 / scheduler.frequency;
+		scheduler.historyNext = (scheduler.historyNext + 1) % frameHistoryLength;
+		scheduler.historySize = std::min(scheduler.historySize + 1, frameHistoryLength);
+		scheduler.accumulated += elapsed;
+	}
+	else scheduler.accumulated = scheduler.updateStep;
+	scheduler.frameStart = now;
+
+	// A frame less than an interval late keeps the schedule; later than that, the schedule restarts from now.
+	scheduler.nextFrame += scheduler.frameInterval;
+	if (scheduler.nextFrame <= now) scheduler.nextFrame = now + scheduler.frameInterval;
+
+	if (scheduler.updateStep == 0) return 0;
+	Uint64 updates = scheduler.accumulated / scheduler.updateStep;
+	if (updates > static_cast<Uint64>(maxUpdatesPerFrame)) {
+		updates = maxUpdatesPerFrame;
+		scheduler.accumulated = updates * scheduler.updateStep;
+	}
+	scheduler.accumulated -= updates * scheduler.updateStep;
+	return static_cast<int>(updates);
+}
+
+void endFrame(frameScheduler &scheduler) {
+	const Uint64 work = SDL_GetPerformanceCounter() - scheduler.frameStart;
+	scheduler.lastWork = work * 1000.0 / scheduler.frequency;
+	if (work > scheduler.budget) ++scheduler.overBudget;
+}
+
+// How far the frame is between the last update and the next, from 0 to 1, for drawing between states.
+double frameBlend(const frameScheduler &scheduler) {
+	return scheduler.updateStep ? static_cast<double>(scheduler.accumulated) / scheduler.updateStep : 0;
+}
+
+frameStats queryFrameStats(const frameScheduler &scheduler) {
+	frameStats stats = {};
+	stats.lastWork = scheduler.lastWork;
+	stats.overBudget = scheduler.overBudget;
+	const int size = scheduler.historySize;
+	if (size == 0) return stats;
+	double sorted[frameHistoryLength];
+	std::copy(scheduler.history, scheduler.history + size, sorted);
+	const int p99 = (size * 99 + 99) / 100 - 1;
+	std::nth_element(sorted, sorted + p99, sorted + size);
+	stats.p99 = sorted[p99];
+	stats.minimum = *std::min_element(sorted, sorted + size);
+	double total = 0;
+	for (int i = 0; i < size; ++i) total += sorted[i];
+	stats.average = total / size;
+	return stats;
+}
+
+
+// // VIDEO SINK // //
+
+// YUV4MPEG2 with 4:2:0 chroma, which encoders like ffmpeg and x264 read from a pipe, or headerless
+// R, G, B, A frames for encoders told the size and rate on their command line.
+enum class videoFormat { y4m, rgba };
+
+// Frames converted and waiting for the writer thread. When all of them are waiting the renderer drops
+// its frame, or waits if it asked to, so a slow encoder can't hold up drawing.
+const int videoQueueLength = 4;
+
+// Writes canvases as video frames to a file or pipe. The renderer converts each frame into a free queue
+// slot and moves on; a writer thread streams the slots out in order. Slots change hands through two
+// semaphores, so each slot index is only touched by one side at a time.
+struct videoSink {
+	videoFormat format;
+	int width, height;
+	std::string path;
+	imageStream stream;
+	std::vector<std::uint8_t> frames[videoQueueLength];
+	std::vector<std::uint32_t> rows;      // ARGB8888 rows widened from canvases in other formats
+	SDL_sem* queued;                      // frames to write, plus one post when closing
+	SDL_sem* free;                        // slots the renderer may fill
+	std::atomic<std::uint64_t> submitted; // frames queued so far
+	std::uint64_t dropped;                // render side only
+	int head;                             // render side only
+	std::thread writer;
+#if !defined(_WIN32)
+	void (*previousSigpipe)(int);         // handler to restore when the sink closes
+#endif
+};
+
+// Returns row of image as ARGB8888 pixels, widening it into scratch when the canvas has another format.
+// index8 canvases are read as gray.
+const std::uint32_t* rowAsARGB(const canvas &image, int row, std::uint32_t* scratch) {
+	const std::uint8_t* source = image.pixels + static_cast<std::ptrdiff_t>(row) * image.pitch;
+	switch (image.format) {
+	case pixelFormat::argb8888: return reinterpret_cast<const std::uint32_t*>(source);
+	case pixelFormat::rgb565:
+		for (int x = 0; x < image.width; ++x) {
+			const std::uint32_t pixel = formatRGB565::load(source + x * 2);
+			const std::uint32_t red = pixel >> 11, green = (pixel >> 5) & 0x3F, blue = pixel & 0x1F;
+			scratch[x] = 0xFF000000u | (((red << 3) | (red >> 2)) << 16) | (((green << 2) | (green >> 4)) << 8) | ((blue << 3) | (blue >> 2));
+		}
+		break;
+	case pixelFormat::rgb24:
+		for (int x = 0; x < image.width; ++x) scratch[x] = 0xFF000000u | formatRGB24::load(source + x * 3);
+		break;
+	case pixelFormat::index8:
+		for (int x = 0; x < image.width; ++x) scratch[x] = 0xFF000000u | source[x] * 0x010101u;
+		break;
+	}
+	return scratch;
+}
+
+// BT.601 studio-range luma of an 8-bit color, and the chroma of an averaged 2x2 block.
+inline std::uint8_t lumaOf(int red, int green, int blue) {
+	return static_cast<std::uint8_t>(((66 * red + 129 * green + 25 * blue + 128) >> 8) + 16);
+}
+inline std::uint8_t chromaBlueOf(int red, int green, int blue) {
+	return static_cast<std::uint8_t>(((-38 * red - 74 * green + 112 * blue + 128) >> 8) + 128);
+}
+inline std::uint8_t chromaRedOf(int red, int green, int blue) {
+	return static_cast<std::uint8_t>(((112 * red - 94 * green - 18 * blue + 128) >> 8) + 128);
+}
+
+// Converts a pair of ARGB8888 rows to 4:2:0: a luma sample per pixel, and one Cb and Cr per 2x2 block
+// from the block's average color. An odd last column pairs with itself; pass the same row twice for an
+// odd last row. SSE2 converts eight columns of both rows per step in 16-bit lanes; luma sums can pass
+// 32767, so they are shifted down as unsigned.
+void convertToYUV420(const std::uint32_t* top, const std::uint32_t* bottom, int width,
+	std::uint8_t* lumaTop, std::uint8_t* lumaBottom, std::uint8_t* chromaBlue, std::uint8_t* chromaRed) {
+	int x = 0;
+#if DRAW_SSE2
+	const __m128i low = _mm_set1_epi32(0xFF);
+	const __m128i ones = _mm_set1_epi16(1);
+	auto channels = [&](const std::uint32_t* pixels, __m128i &red, __m128i &green, __m128i &blue) {
+		const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels));
+		const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + 4));
+		blue = _mm_packs_epi32(_mm_and_si128(first, low), _mm_and_si128(second, low));
+		green = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(first, 8), low), _mm_and_si128(_mm_srli_epi32(second, 8), low));
+		red = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(first, 16), low), _mm_and_si128(_mm_srli_epi32(second, 16), low));
+	};
+	auto luma = [](__m128i red, __m128i green, __m128i blue) {
+		const __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(red, _mm_set1_epi16(66)), _mm_mullo_epi16(green, _mm_set1_epi16(129))),
+			_mm_add_epi16(_mm_mullo_epi16(blue, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+		return _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(16));
+	};
+	// Averages each 2x2 block of a channel, giving four values in the low 16-bit lanes.
+	auto average = [&](__m128i upper, __m128i lower) {
+		const __m128i sums = _mm_madd_epi16(_mm_add_epi16(upper, lower), ones);
+		const __m128i averages = _mm_srli_epi32(_mm_add_epi32(sums, _mm_set1_epi32(2)), 2);
+		return _mm_packs_epi32(averages, averages);
+	};
+	auto chroma = [](__m128i red, __m128i green, __m128i blue, short redWeight, short greenWeight, short blueWeight) {
+		const __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(red, _mm_set1_epi16(redWeight)), _mm_mullo_epi16(green, _mm_set1_epi16(greenWeight))),
+			_mm_add_epi16(_mm_mullo_epi16(blue, _mm_set1_epi16(blueWeight)), _mm_set1_epi16(128)));
+		return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi16(128));
+	};
+	for (; x + 8 <= width; x += 8) {
+		__m128i redTop, greenTop, blueTop, redBottom, greenBottom, blueBottom;
+		channels(top + x, redTop, greenTop, blueTop);
+		channels(bottom + x, redBottom, greenBottom, blueBottom);
+		const __m128i lumas = _mm_packus_epi16(luma(redTop, greenTop, blueTop), luma(redBottom, greenBottom, blueBottom));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(lumaTop + x), lumas);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(lumaBottom + x), _mm_srli_si128(lumas, 8));
+
+		const __m128i red = average(redTop, redBottom), green = average(greenTop, greenBottom), blue = average(blueTop, blueBottom);
+		const __m128i chromas = _mm_packus_epi16(chroma(red, green, blue, -38, -74, 112), chroma(red, green, blue, 112, -94, -18));
+		const int blues = _mm_cvtsi128_si32(chromas), reds = _mm_cvtsi128_si32(_mm_srli_si128(chromas, 8));
+		std::memcpy(chromaBlue + x / 2, &blues, 4);
+		std::memcpy(chromaRed + x / 2, &reds, 4);
+	}
+#endif
+	for (; x < width; x += 2) {
+		const int right = std::min(x + 1, width - 1);
+		const std::uint32_t block[4] = { top[x], top[right], bottom[x], bottom[right] };
+		int red = 2, green = 2, blue = 2;
+		for (int i = 0; i < 4; ++i) {
+			red += (block[i] >> 16) & 0xFF;
+			green += (block[i] >> 8) & 0xFF;
+			blue += block[i] & 0xFF;
+		}
+		for (int i = 0; i < 2 && x + i < width; ++i) {
+			lumaTop[x + i] = lumaOf((block[i] >> 16) & 0xFF, (block[i] >> 8) & 0xFF, block[i] & 0xFF);
+			lumaBottom[x + i] = lumaOf((block[2 + i] >> 16) & 0xFF, (block[2 + i] >> 8) & 0xFF, block[2 + i] & 0xFF);
+		}
+		chromaBlue[x / 2] = chromaBlueOf(red >> 2, green >> 2, blue >> 2);
+		chromaRed[x / 2] = chromaRedOf(red >> 2, green >> 2, blue >> 2);
+	}
+}
+
+// Writer thread. Every post of queued is one frame, except the last, which closeVideoSink posts after
+// all frames; it is recognised by every submitted frame having been written. After a failed write the
+// frames are still taken off the queue, so the renderer never blocks on a dead pipe.
+void writeVideoFrames(videoSink &sink) {
+	std::uint64_t written = 0;
+	int tail = 0;
+	for (;;) {
+		SDL_SemWait(sink.queued);
+		if (written == sink.submitted.load(std::memory_order_acquire)) return;
+		if (sink.format == videoFormat::y4m) stageText(sink.stream, "FRAME\n");
+		streamBytes(sink.stream, sink.frames[tail].data(), sink.frames[tail].size());
+		flushImageStream(sink.stream);
+		++written;
+		tail = (tail + 1) % videoQueueLength;
+		SDL_SemPost(sink.free);
+	}
+}
+
+// Starts a video of width by height frames at framesPerSecond, written to path, or to standard output
+// when path is "-". Y4M frames need no other description; for rgba the encoder must be told the size,
+// rate and pixel format.
+bool openVideoSink(videoSink &sink, const std::string &path, int width, int height, int framesPerSecond, videoFormat format = videoFormat::y4m) {
+	if (!openImageStream(sink.stream, path)) return false;
+#if !defined(_WIN32)
+	// An encoder that exits closes the pipe; the writes after that should fail, not kill the renderer.
+	// The handler is only replaced while the sink is open.
+	sink.previousSigpipe = std::signal(SIGPIPE, SIG_IGN);
+#endif
+	sink.format = format;
+	sink.width = width;
+	sink.height = height;
+	sink.path = path;
+	const std::size_t pixels = static_cast<std::size_t>(width) * height;
+	const std::size_t chroma = static_cast<std::size_t>((width + 1) / 2) * ((height + 1) / 2);
+	for (int i = 0; i < videoQueueLength; ++i) sink.frames[i].resize(format == videoFormat::y4m ? pixels + 2 * chroma : pixels * 4);
+	sink.rows.resize(static_cast<std::size_t>(width) * 2);
+	if (format == videoFormat::y4m) {
+		char header[128];
+		std::snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, framesPerSecond);
+		stageText(sink.stream, header);
+	}
+	sink.queued = SDL_CreateSemaphore(0);
+	sink.free = SDL_CreateSemaphore(videoQueueLength);
+	sink.submitted.store(0, std::memory_order_relaxed);
+	sink.dropped = 0;
+	sink.head = 0;
+	sink.writer = std::thread(writeVideoFrames, std::ref(sink));
+	return true;
+}
+
+// Converts image into the next free slot and queues it. When every slot is queued the frame is dropped
+// and counted, unless wait is set, in which case this waits for the writer. Returns whether the frame
+// was queued.
+bool submitVideoFrame(videoSink &sink, const canvas &image, bool wait = false) {
+	if (image.width != sink.width || image.height != sink.height) {
+		SDL_SetError("Frame is %dx%d, video is %dx%d", image.width, image.height, sink.width, sink.height);
+		return false;
+	}
+	if (wait) SDL_SemWait(sink.free);
+	else if (SDL_SemTryWait(sink.free) != 0) {
+		++sink.dropped;
+		return false;
+	}
+
+	std::uint8_t* frame = sink.frames[sink.head].data();
+	std::uint32_t* scratch = sink.rows.data();
+	if (sink.format == videoFormat::rgba) {
+		for (int row = 0; row < sink.height; ++row) {
+			swizzleToRGBA(reinterpret_cast<const std::uint8_t*>(rowAsARGB(image, row, scratch)),
+				frame + static_cast<std::size_t>(row) * sink.width * 4, sink.width);
+		}
+	}
+	else {
+		const int chromaWidth = (sink.width + 1) / 2;
+		std::uint8_t* luma = frame;
+		std::uint8_t* chromaBlue = luma + static_cast<std::size_t>(sink.width) * sink.height;
+		std::uint8_t* chromaRed = chromaBlue + static_cast<std::size_t>(chromaWidth) * ((sink.height + 1) / 2);
+		for (int row = 0; row < sink.height; row += 2) {
+			const int next = std::min(row + 1, sink.height - 1);
+			const std::uint32_t* top = rowAsARGB(image, row, scratch);
+			const std::uint32_t* bottom = rowAsARGB(image, next, scratch + sink.width);
+			convertToYUV420(top, bottom, sink.width, luma + static_cast<std::size_t>(row) * sink.width, luma + static_cast<std::size_t>(next) * sink.width,
+				chromaBlue + static_cast<std::size_t>(row / 2) * chromaWidth, chromaRed + static_cast<std::size_t>(row / 2) * chromaWidth);
+		}
+	}
+
+	sink.head = (sink.head + 1) % videoQueueLength;
+	sink.submitted.fetch_add(1, std::memory_order_release);
+	SDL_SemPost(sink.queued);
+	return true;
+}
+
+// Writes the frames still queued, stops the writer and closes the output. Returns false, with the SDL
+// error set, if any frame failed to write.
+bool closeVideoSink(videoSink &sink) {
+	SDL_SemPost(sink.queued);
+	sink.writer.join();
+	SDL_DestroySemaphore(sink.queued);
+	SDL_DestroySemaphore(sink.free);
+	if (sink.dropped > 0) SDL_Log("Dropped %llu of %llu video frames", static_cast<unsigned long long>(sink.dropped),
+		static_cast<unsigned long long>(sink.dropped + sink.submitted.load()));
+	const bool closed = closeImageStream(sink.stream, sink.path);
+#if !defined(_WIN32)
+	if (sink.previousSigpipe != SIG_ERR) std::signal(SIGPIPE, sink.previousSigpipe);
+#endif
+	return closed;
+}
+
+
+// // FRAME LOOP // //
+
+// SDL 2.0.3 sleeps 10 ms at a time inside SDL_WaitEventTimeout, too coarse to hold 60 Hz, so the last
+// stretch before a frame is slept with SDL_Delay and finished with a poll.
+const int eventWaitGranularity = 10;
+
+// Waits up to timeout milliseconds for an event, or until one arrives when timeout is negative.
+int waitForEvent(SDL_Event* event, int timeout) {
+	if (timeout < 0) return SDL_WaitEvent(event);
+	if (timeout > eventWaitGranularity) return SDL_WaitEventTimeout(event, timeout - eventWaitGranularity);
+	SDL_Delay(timeout);
+	return SDL_PollEvent(event);
+}
+
+// Runs the window until it is closed. The loop sleeps until an event arrives or the scheduler's next
+// frame is due, and presents only when something changed the window surface. Each frame runs onTick()
+// once per fixed update the scheduler asks for; a scheduler without updates leaves the loop blocked
+// until the next event. onEvent(event) and onTick() return true when they drew. present(exposed) is
+// called after drawing, and with exposed set when the window needs its whole contents again.
+template <typename OnEvent, typename OnTick, typename Present>
+void runFrameLoop(frameScheduler &scheduler, OnEvent onEvent, OnTick onTick, Present present) {
+	const bool animating = scheduler.updateStep != 0;
+	bool dirty = true, exposed = true;
+	for (;;) {
+		const bool framing = animating && frameDue(scheduler);
+		if (framing) {
+			const int updates = beginFrame(scheduler);
+			for (int i = 0; i < updates; ++i) {
+				if (onTick()) dirty = true;
+			}
+		}
+		if (dirty) {
+			present(exposed);
+			dirty = exposed = false;
+		}
+		if (framing) endFrame(scheduler);
+
+		// // WAIT FOR AN EVENT OR THE NEXT FRAME
+		SDL_Event event;
+		int pending = waitForEvent(&event, animating ? millisecondsToNextFrame(scheduler) : -1);
+
+		// // HANDLE EVERY QUEUED EVENT BEFORE PRESENTING
+		while (pending) {
+			if (event.type == SDL_QUIT) return;
+			if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED) dirty = exposed = true;
+			if (onEvent(event)) dirty = true;
+			pending = SDL_PollEvent(&event);
+		}
+	}
+}
+
+// // RENDER THREAD // //
+
+// Commands the event loop may queue ahead of the render thread before it waits for it to catch up.
+const int renderQueueLength = 64;
+
+// One job for the render thread: an event to draw, or a frame to present.
+struct renderCommand {
+	bool present;
+	bool exposed;
+	SDL_Event event;
+};
+
+// Draws on a thread of its own, so that drawing the next frame overlaps the event loop uploading the
+// last one. The event loop keeps SDL to itself and queues events and presents in order; the render
+// thread owns the swap chain's back buffer and submits frames through its ready slot. Slots change
+// hands through two semaphores, as in the video sink.
+struct renderThread {
+	renderCommand commands[renderQueueLength];
+	SDL_sem* queued;                      // commands to run, plus one post when closing
+	SDL_sem* free;                        // slots the event loop may fill
+	std::atomic<std::uint64_t> submitted; // commands queued so far
+	int head;                             // event side only
+	std::thread worker;
+};
+
+// Render thread. Runs onEvent(event) and present(exposed) for each command in the order it was queued,
+// and returns once the commands queued before closing are done.
+template <typename OnEvent, typename Present>
+void runRenderCommands(renderThread &renderer, OnEvent onEvent, Present present) {
+	std::uint64_t done = 0;
+	int tail = 0;
+	for (;;) {
+		SDL_SemWait(renderer.queued);
+		if (done == renderer.submitted.load(std::memory_order_acquire)) return;
+		const renderCommand &command = renderer.commands[tail];
+		if (command.present) present(command.exposed);
+		else onEvent(command.event);
+		++done;
+		tail = (tail + 1) % renderQueueLength;
+		SDL_SemPost(renderer.free);
+	}
+}
+
+// Starts the render thread. onEvent and present run on it, with the meaning they have for runFrameLoop
+// except that what they return is ignored: the event loop decides when to present.
+template <typename OnEvent, typename Present>
+void openRenderThread(renderThread &renderer, OnEvent onEvent, Present present) {
+	renderer.queued = SDL_CreateSemaphore(0);
+	renderer.free = SDL_CreateSemaphore(renderQueueLength);
+	renderer.submitted.store(0, std::memory_order_relaxed);
+	renderer.head = 0;
+	renderer.worker = std::thread([&renderer, onEvent, present]() { runRenderCommands(renderer, onEvent, present); });
+}
+
+// Queues a command, waiting for a free slot when the render thread is a full queue behind.
+void queueRenderCommand(renderThread &renderer, const renderCommand &command) {
+	SDL_SemWait(renderer.free);
+	renderer.commands[renderer.head] = command;
+	renderer.head = (renderer.head + 1) % renderQueueLength;
+	renderer.submitted.fetch_add(1, std::memory_order_release);
+	SDL_SemPost(renderer.queued);
+}
+
+void queueRenderEvent(renderThread &renderer, const SDL_Event &event) {
+	renderCommand command = {};
+	command.event = event;
+	queueRenderCommand(renderer, command);
+}
+
+void queueRenderPresent(renderThread &renderer, bool exposed) {
+	renderCommand command = {};
+	command.present = true;
+	command.exposed = exposed;
+	queueRenderCommand(renderer, command);
+}
+
+// Runs the commands still queued and stops the render thread.
+void closeRenderThread(renderThread &renderer) {
+	SDL_SemPost(renderer.queued);
+	renderer.worker.join();
+	SDL_DestroySemaphore(renderer.queued);
+	SDL_DestroySemaphore(renderer.free);
+}
+
+// The test scene: a pixel and a starburst of lines.
+void drawStarburst(std::uint32_t color, const canvas &target) {
+	// // DEFINE LINE PROPERTIES // //
+	coordinate pixelCoord;
+	pixelCoord.x = 10; pixelCoord.y = 10;
+	drawPixel(pixelCoord, color, target);
+
+	int startX = 300;
+	int startY = 300;
+	int endX[] = { 300, 300, 380 ,450, 480, 500, 480, 450, 380, 300, 220, 150, 120, 100, 120, 150, 200 };
+	int endY[] = { 300, 100, 130 ,150, 220, 300, 380, 450, 480, 500, 480, 450, 390, 300, 220, 150, 130 };
+	int numLines = sizeof(endX) / sizeof(endX[0]);
+
+
+	// // CREATE LINE DATA STRUCTURES // //
+	lineBuffer lines;
+	lines.reserve(numLines);
+	for (int i = 0; i < numLines; ++i) {
+		coordinate tempStart;
+		coordinate tempEnd;
+		line tempLine;
+		tempStart.x = startX;
+		tempStart.y = startY;
+		tempEnd.x = endX[i];
+		tempEnd.y = endY[i];
+		tempLine.start = tempStart;
+		tempLine.end = tempEnd;
+		lines.push_back(tempLine);
+	}
+
+	// // DRAW LINES // //
+	drawLines(lines, color, target);
+}
+
+
+int main(int argc, char** argv) {
+	const bool batch = argc > 3 && std::string(argv[1]) == "--batch";
+	const bool record = argc > 2 && std::string(argv[1]) == "--record";
+	const bool headless = batch || (argc > 2 && std::string(argv[1]) == "--headless");
+	if (headless) useHeadlessVideo();
+	SDL_Init(headless ? SDL_INIT_VIDEO | SDL_INIT_TIMER : SDL_INIT_EVERYTHING);
+	std::atexit(&SDL_Quit);
+
+	if (argc > 1 && std::string(argv[1]) == "--bench") {
+		benchmarkLines(20000, 400);
+		benchmarkBatch(1000000, 8);
+		benchmarkBatch(1000000, 32);
+		benchmarkParallel(100000);
+		return 0;
+	}
+
+	// // RENDER A DIRECTORY OR MANIFEST OF SCENES // //
+	if (batch) {
+		const std::string extension = argc > 5 ? std::string(".") + argv[5] : ".bmp";
+		return renderBatch(argv[2], argv[3], argc > 4 ? std::atoi(argv[4]) : 0, extension.c_str()) == 0 ? 0 : 1;
+	}
+
+	// // RENDER A POSTER STRAIGHT INTO A MAPPED FILE // //
+	if (headless && argc > 4) {
+		canvasFile s_poster;
+		if (!openCanvasFile(s_poster, argv[2], std::atoi(argv[3]), std::atoi(argv[4]))) {
+			SDL_Log("Can't map %s: %s", argv[2], SDL_GetError());
+			return 1;
+		}
+		fillRect({ 0, 0, s_poster.target.width, s_poster.target.height }, 0xFFFFFFFF, s_poster.target);
+		drawStarburst(0xFFFF0000, s_poster.target);
+		const bool saved = closeCanvasFile(s_poster);
+		if (!saved) SDL_Log("Can't save %s: %s", argv[2], SDL_GetError());
+		return saved ? 0 : 1;
+	}
+
+	// // RENDER TO A FILE WITHOUT A WINDOW // //
+	if (headless) {
+		canvas s_image = createCanvas(1280, 720);
+		fillRect({ 0, 0, s_image.width, s_image.height }, 0xFFFFFFFF, s_image);
+		drawStarburst(0xFFFF0000, s_image);
+		const bool saved = saveCanvas(s_image, argv[2]);
+		if (!saved) SDL_Log("Can't save %s: %s", argv[2], SDL_GetError());
+		destroyCanvas(s_image);
+		return saved ? 0 : 1;
+	}
+
+
+
+
+	auto s_window = SDL_CreateWindow("Fuck me", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280u, 720u, 0u);
+	auto s_surface = SDL_GetWindowSurface(s_window);
+	SDL_FillRect(s_surface, nullptr, 0xFFFFFFFF);
+	swapChain s_chain;
+	if (!openSwapChain(s_chain, s_window)) {
+		SDL_Log("Can't draw to this window: %s", SDL_GetError());
+		SDL_DestroyWindow(s_window);
+		return 1;
+	}
+
+	auto s_last_x = 0;
+	auto s_last_y = 0;
+	auto s_size = 0;
+
+
+	int red = 0xFFFF0000;
+	drawStarburst(red, s_chain.backBuffer());
+
+	// // RECORD EVERY FRAME TO A VIDEO // //
+	videoSink s_video;
+	const int s_videoRate = 60;
+	if (record) {
+		const std::string path = argv[2];
+		const videoFormat format = endsWith(path, ".rgba") ? videoFormat::rgba : videoFormat::y4m;
+		if (!openVideoSink(s_video, path, s_chain.backBuffer().width, s_chain.backBuffer().height, s_videoRate, format)) {
+			SDL_Log("Can't record to %s: %s", argv[2], SDL_GetError());
+			closeSwapChain(s_chain);
+			SDL_DestroyWindow(s_window);
+			return 1;
+		}
+	}
+
+
+	// // DRAW WITH THE MOUSE ON THE RENDER THREAD // //
+	auto s_drawsWith = [](const SDL_Event &event) {
+		return (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT)
+			|| (event.type == SDL_MOUSEMOTION && (event.motion.state & SDL_BUTTON_LMASK));
+	};
+	renderThread s_renderer;
+	openRenderThread(s_renderer, [&](const SDL_Event &event) {
+		if (event.type == SDL_MOUSEBUTTONDOWN) {
+			s_last_x = event.button.x;
+			s_last_y = event.button.y;
+			drawPixel({ s_last_x, s_last_y }, red, s_chain.backBuffer());
+		}
+		else {
+			const coordinate stroke[] = { { s_last_x, s_last_y }, { event.motion.x, event.motion.y } };
+			drawPolyline(stroke, 2, red, s_chain.backBuffer());
+			s_last_x = event.motion.x;
+			s_last_y = event.motion.y;
+		}
+	}, [&](bool exposed) {
+		if (record) submitVideoFrame(s_video, s_chain.backBuffer());
+		if (s_chain.backBuffer().damage->numRects > 0) submitFrame(s_chain);
+		if (exposed) representFrame(s_chain);
+	});
+
+	frameScheduler s_scheduler = createFrameScheduler(record ? s_videoRate : 0);
+	runFrameLoop(s_scheduler, [&](const SDL_Event &event) {
+		if (uploadSwapChain(s_chain, event)) return false;
+		if (!s_drawsWith(event)) return false;
+		queueRenderEvent(s_renderer, event);
+		return true;
+	}, [&]() { return record; }, [&](bool exposed) {
+		queueRenderPresent(s_renderer, exposed);
+	});
+	closeRenderThread(s_renderer);
 
+	const bool recorded = !record || closeVideoSink(s_video);
+	if (!recorded) SDL_Log("Can't record to %s: %s", argv[2], SDL_GetError());
+	closeSwapChain(s_chain);
 	SDL_DestroyWindow(s_window);
-	return 0;
+	return recorded ? 0 : 1;
 }
\ No newline at end of file